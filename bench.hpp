@@ -0,0 +1,210 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using stopwatch_t =
+struct stopwatch {
+    using clock = std::chrono::steady_clock;
+    clock::time_point start = clock::now();
+
+    double ms() const {
+        return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+    double lap(){
+        clock::time_point now = clock::now();
+        double t = std::chrono::duration<double, std::milli>(now - start).count();
+        start = now;
+        return t;
+    }
+};
+
+// per-frame stage timings (ms) and triangle counters, filled in by the render loop
+using stats_t =
+struct stats {
+    double clear = 0.0;
+    double mvp = 0.0;
+    double cull = 0.0;
+    double transform = 0.0;
+    double bin = 0.0;
+    double raster = 0.0;
+    double shade = 0.0;        // the visibility buffer's shading pass
+    double resolve = 0.0;
+    double frame = 0.0;
+    double scale = 1.0;        // render resolution per axis, relative to the output
+    size_t missed = 0;         // 1 when the frame ran over the resolution budget
+    size_t lods[8] = {};       // instances drawn at each level of detail
+    size_t instances = 0;      // in the scene
+    size_t instancesDrawn = 0; // that reached the vertex stage
+    size_t instancesOccluded = 0; // whole instances the hierarchical z rejected
+    size_t draws = 0;          // vertex, bin and raster passes
+    size_t vertices = 0;
+    size_t submitted = 0;
+    size_t rasterized = 0;
+    size_t culled = 0;
+    size_t rejected = 0;
+    size_t clipped = 0;
+    size_t occluded = 0;       // triangle/tile pairs rejected by the hierarchical z
+    size_t occludedBlocks = 0; // 8x8 blocks it skipped inside drawn triangles
+    size_t tested = 0;         // pixels covered while rasterizing, depth tested
+    size_t fragments = 0;      // of those, the pixels that passed the depth test
+    size_t shaded = 0;         // fragment shader runs, forward or in the shading pass
+    size_t l1dMisses = 0;      // hardware counters over the frame, see perfcounters.hpp
+    size_t llcMisses = 0;
+    size_t dtlbMisses = 0;
+};
+
+inline double percentile(std::vector<double> v, double p){
+    if(v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const double rank = p * static_cast<double>(v.size() - 1);
+    const size_t lo = static_cast<size_t>(rank);
+    const size_t hi = std::min(lo + 1, v.size() - 1);
+    return v[lo] + (v[hi] - v[lo]) * (rank - static_cast<double>(lo));
+}
+
+// what a benchmark line was measured with
+using runinfo_t =
+struct runinfo {
+    std::string model;
+    std::string isa;
+    std::string depth;
+    std::string shade;
+    int width;
+    int height;
+    int threads;
+    bool hiz;
+    int msaa;          // samples per pixel
+    bool visibility;   // shaded through a visibility buffer
+    bool tiled;        // targets stored tile by tile, see pixelOffset
+    bool counters;     // the cache miss counters could be read
+    double load;       // ms
+    double budget;     // ms the resolution scaler holds frames to, 0 when off
+    double sourceAcmr; // vertex cache misses per face, obj order
+    double acmr;       // and as drawn, see vertexcache.hpp
+};
+
+using benchmark_t =
+struct benchmark {
+    void record(const stats_t& s){ samples.push_back(s); }
+
+    // writes one JSON object per run so CI can diff runs line by line
+    void report(std::ostream& out, const runinfo_t& run) const {
+        auto series = [&](double stats_t::* field){
+            std::vector<double> v;
+            v.reserve(samples.size());
+            for(const auto& s : samples) v.push_back(s.*field);
+            return v;
+        };
+        auto summary = [&](double stats_t::* field){
+            std::vector<double> v = series(field);
+            double sum = 0.0;
+            for(double x : v) sum += x;
+            out << '{'
+                << "\"mean\":" << (v.empty() ? 0.0 : sum / v.size()) << ','
+                << "\"p50\":"  << percentile(v, 0.50) << ','
+                << "\"p95\":"  << percentile(v, 0.95) << ','
+                << "\"p99\":"  << percentile(v, 0.99) << '}';
+        };
+
+        double total = 0.0;
+        size_t vertices = 0, submitted = 0, rasterized = 0, culled = 0, rejected = 0, clipped = 0;
+        size_t occluded = 0, occludedBlocks = 0, missed = 0;
+        size_t instances = 0, instancesDrawn = 0, instancesOccluded = 0, draws = 0, tested = 0, fragments = 0, shaded = 0;
+        size_t l1dMisses = 0, llcMisses = 0, dtlbMisses = 0;
+        std::vector<size_t> lods;
+        for(const auto& s : samples){
+            for(size_t i = 0; i < std::size(s.lods); i++){
+                if(!s.lods[i]) continue;
+                if(i >= lods.size()) lods.resize(i + 1, 0);
+                lods[i] += s.lods[i];
+            }
+            instances += s.instances;
+            instancesDrawn += s.instancesDrawn;
+            instancesOccluded += s.instancesOccluded;
+            draws += s.draws;
+            tested += s.tested;
+            fragments += s.fragments;
+            shaded += s.shaded;
+            l1dMisses += s.l1dMisses;
+            llcMisses += s.llcMisses;
+            dtlbMisses += s.dtlbMisses;
+            total += s.frame;
+            vertices += s.vertices;
+            culled += s.culled;
+            rejected += s.rejected;
+            clipped += s.clipped;
+            occluded += s.occluded;
+            occludedBlocks += s.occludedBlocks;
+            submitted += s.submitted;
+            rasterized += s.rasterized;
+            missed += s.missed;
+        }
+        const double seconds = total / 1000.0;
+
+        out << '{'
+            << "\"model\":\"" << run.model << "\","
+            << "\"isa\":\"" << run.isa << "\","
+            << "\"depth\":\"" << run.depth << "\","
+            << "\"shade\":\"" << run.shade << "\","
+            << "\"width\":" << run.width << ','
+            << "\"height\":" << run.height << ','
+            << "\"threads\":" << run.threads << ','
+            << "\"hiz\":" << (run.hiz ? "true" : "false") << ','
+            << "\"msaa\":" << run.msaa << ','
+            << "\"visibility\":" << (run.visibility ? "true" : "false") << ','
+            << "\"layout\":\"" << (run.tiled ? "tiled" : "linear") << "\","
+            << "\"load_ms\":" << run.load << ','
+            << "\"budget_ms\":" << run.budget << ','
+            << "\"acmr\":{\"source\":" << run.sourceAcmr << ",\"ordered\":" << run.acmr << "},"
+            << "\"frames\":" << samples.size() << ',';
+        out << "\"stages_ms\":{";
+        out << "\"clear\":";     summary(&stats_t::clear);     out << ',';
+        out << "\"mvp\":";       summary(&stats_t::mvp);       out << ',';
+        out << "\"cull\":";      summary(&stats_t::cull);      out << ',';
+        out << "\"transform\":"; summary(&stats_t::transform); out << ',';
+        out << "\"bin\":";       summary(&stats_t::bin);       out << ',';
+        out << "\"raster\":";    summary(&stats_t::raster);    out << ',';
+        out << "\"shade\":";     summary(&stats_t::shade);     out << ',';
+        out << "\"resolve\":";   summary(&stats_t::resolve);
+        out << "},";
+        out << "\"frame_ms\":";  summary(&stats_t::frame);     out << ',';
+        out << "\"scale\":";     summary(&stats_t::scale);     out << ',';
+        out << "\"budget_misses\":" << missed << ',';
+        const double frames = samples.empty() ? 1.0 : static_cast<double>(samples.size());
+        // instances a 60 fps frame (16.7 ms) would fit at this run's mean cost
+        // per instance, taking the frame to scale linearly with them
+        const double budget60 = total > 0.0 ? instances / total * (1000.0 / 60.0) : 0.0;
+        out << "\"instances\":" << instances / frames << ','
+            << "\"instances_at_60fps\":" << budget60 << ','
+            << "\"instances_drawn\":" << instancesDrawn / frames << ','
+            << "\"instances_occluded\":" << instancesOccluded / frames << ','
+            << "\"draws\":" << draws / frames << ','
+            << "\"fragments\":{\"tested\":" << tested / frames << ",\"rasterized\":" << fragments / frames
+            << ",\"shaded\":" << shaded / frames << "},";
+        out << "\"cache_misses\":";
+        if(run.counters)
+            out << "{\"l1d\":" << l1dMisses / frames << ",\"llc\":" << llcMisses / frames
+                << ",\"dtlb\":" << dtlbMisses / frames << "},";
+        else out << "null,";
+        out << "\"lod_instances\":[";
+        for(size_t i = 0; i < lods.size(); i++) out << (i ? "," : "") << lods[i];
+        out << "],";
+        out << "\"vertices_transformed\":" << vertices << ','
+            << "\"triangles_submitted\":" << submitted << ','
+            << "\"triangles_rasterized\":" << rasterized << ','
+            << "\"triangles_culled\":" << culled << ','
+            << "\"triangles_rejected\":" << rejected << ','
+            << "\"triangles_clipped\":" << clipped << ','
+            << "\"hiz_tile_triangles_rejected\":" << occluded << ','
+            << "\"hiz_blocks_rejected\":" << occludedBlocks << ','
+            << "\"triangles_per_sec\":" << (seconds > 0.0 ? submitted / seconds : 0.0)
+            << '}' << std::endl;
+    }
+
+    std::vector<stats_t> samples;
+};
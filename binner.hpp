@@ -0,0 +1,188 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <omp.h>
+#include <vector>
+
+#include "clip.hpp"
+#include "depthbuffer.hpp"
+#include "framebuffer.hpp"
+#include "raster.hpp"
+#include "trace.hpp"
+#include "vertex.hpp"
+
+// Sort-middle binning: triangles are clipped and set up in parallel and appended
+// to the screen tiles their bounding box touches, then each tile is rasterized
+// by a single thread, so no two threads ever write the same pixel. Tiles are the
+// framebuffer's TILE x TILE lazy-clear tiles.
+static_assert(TILE == hiz_t::BLOCK * hiz_t::COARSE, "tiles resolve one coarse hiz tile each");
+
+using binner_t =
+struct binner {
+    int tilesX = 0, tilesY = 0;
+    // per-thread set-up triangles and bins[thread][tile] indices into them; each
+    // thread bins a contiguous run of faces, so walking the threads in order
+    // replays the submission order inside every tile
+    std::vector<std::vector<triangle_t>> triangles;
+    std::vector<std::vector<varyings_t>> varyings; // parallel to triangles on the shaded path
+    std::vector<std::vector<std::vector<uint32_t>>> bins;
+    // faces surviving bvh culling, with where their instance's vertices are
+    struct face { uint32_t index, instance; int64_t base; };
+    std::vector<face> visible;
+    // every face binned for a visibility pass since the last clear, triangle
+    // ids being 1 + the index; draws add to it, the frame's shading pass reads it
+    std::vector<face> named;
+
+    struct counters {
+        size_t kept = 0;     // triangles set up and binned, clipped pieces included
+        size_t rejected = 0; // faces trivially rejected against the frustum
+        size_t clipped = 0;  // faces that went through the clipper
+    };
+
+    void emit(const triangle_t& t, const varyings_t* v, int thread){
+        auto& tris = triangles[thread];
+        auto& tiles = bins[thread];
+        const uint32_t index = static_cast<uint32_t>(tris.size());
+        tris.push_back(t);
+        if(v) varyings[thread].push_back(*v);
+        for(int ty = t.ymin / TILE; ty <= t.ymax / TILE; ty++)
+            for(int tx = t.xmin / TILE; tx <= t.xmax / TILE; tx++)
+                tiles[ty * tilesX + tx].push_back(index);
+    }
+
+    // corner i of the clip buffer with what P's vertex shader gives it for f's instance
+    template<typename P>
+    static clipvert_t corner(const clipbuffer_t& vertices, const shading_t& shading, size_t i, const face& f){
+        clipvert_t v = vertices.clip(i);
+        P::vertex::attributes(shading, static_cast<size_t>(static_cast<int64_t>(i) - f.base), f.instance, v.attr);
+        return v;
+    }
+
+    // varying planes of t, whose corners a, b, c came from the clip-space vertices given
+    static varyings_t varyingPlanes(const triangle_t& t, const clipvert_t& a, const clipvert_t& b, const clipvert_t& c,
+                            const shading_t& shading){
+        float corner[3][VARYINGS];
+        const clipvert_t* in[3] = {&a, &b, &c};
+        for(int i = 0; i < 3; i++){
+            const float r = 1.0f / in[i]->w;
+            corner[i][varW] = r;
+            for(int k = 0; k < ATTRIBUTES; k++) corner[i][varW + 1 + k] = in[i]->attr[k] * r;
+        }
+        varyings_t v;
+        setupVaryings(t, corner[0], corner[1], corner[2], v);
+        const float uvArea2 = (b.attr[0] - a.attr[0]) * (c.attr[1] - a.attr[1]) - (b.attr[1] - a.attr[1]) * (c.attr[0] - a.attr[0]);
+        v.level = shading.texture->lod(uvArea2, static_cast<float>(t.area2) / (SUBPIXEL * SUBPIXEL));
+        return v;
+    }
+
+    // faces index the mesh's vertices (1-based, as in the obj), every run's
+    // instance has its transformed ones at its base in the clip buffer; only
+    // faces in the runs are binned, set up for pipeline P and a w x h target
+    // with the given samples per pixel
+    template<typename P>
+    counters bin(const std::vector<vec<uint32_t, 3>>& faces, const std::vector<instancerun_t>& runs,
+                 const clipbuffer_t& vertices, const frustum_t& frustum, int w, int h, int samples,
+                 const shading_t& shading){
+        TRACE_ZONE("bin");
+        visible.clear();
+        for(const auto& r : runs)
+            for(uint32_t i = r.first; i < r.end; i++) visible.push_back({i, r.instance, r.base});
+        const size_t n = visible.size();
+        const size_t first = named.size();
+        if constexpr (namesTriangles<P>) named.insert(named.end(), visible.begin(), visible.end());
+        const int threads = omp_get_max_threads();
+        tilesX = (w + TILE - 1) / TILE;
+        tilesY = (h + TILE - 1) / TILE;
+        triangles.resize(threads);
+        varyings.resize(threads);
+        bins.resize(threads);
+        for(int i = 0; i < threads; i++){
+            triangles[i].clear();
+            varyings[i].clear();
+            bins[i].resize(tilesX * tilesY);
+            for(auto& tile : bins[i]) tile.clear();
+        }
+
+        size_t kept = 0, rejected = 0, clipped = 0;
+        #pragma omp parallel for schedule(static) reduction(+:kept, rejected, clipped)
+        for(size_t k = 0; k < n; k++){
+            const int thread = omp_get_thread_num();
+            const face& it = visible[k];
+            const auto& f = faces[it.index];
+            size_t ia = static_cast<size_t>(it.base + f[0] - 1), ib = static_cast<size_t>(it.base + f[1] - 1),
+                   ic = static_cast<size_t>(it.base + f[2] - 1);
+            const uint16_t ca = vertices.code[ia], cb = vertices.code[ib], cc = vertices.code[ic];
+            // trivial reject: all three corners outside the same frustum plane
+            if(ca & cb & cc & clipFrustum){ rejected++; continue; }
+
+            triangle_t t;
+            t.id = namesTriangles<P> ? static_cast<uint32_t>(first + k + 1) : 0;
+            varyings_t v;
+            // trivial accept: nothing crosses the near plane or the guard band
+            if(!((ca | cb | cc) & clipNeeded)){
+                bool swap;
+                if(!facing<P::state::cull>(vertices.screen(ia), vertices.screen(ib), vertices.screen(ic), swap)) continue;
+                if(swap) std::swap(ib, ic);
+                if(!setupTriangle(vertices.screen(ia), vertices.screen(ib), vertices.screen(ic), w, h, t, samples)) continue;
+                if constexpr (P::varying)
+                    v = varyingPlanes(t, corner<P>(vertices, shading, ia, it), corner<P>(vertices, shading, ib, it),
+                                      corner<P>(vertices, shading, ic, it), shading);
+                emit(t, P::varying ? &v : nullptr, thread);
+                kept++;
+                continue;
+            }
+
+            clipped++;
+            const clipvert_t in[3] = {corner<P>(vertices, shading, ia, it), corner<P>(vertices, shading, ib, it),
+                                      corner<P>(vertices, shading, ic, it)};
+            clipvert_t poly[8];
+            const int m = clipPolygon(in, (ca | cb | cc) & clipNeeded, frustum, poly);
+            if(m < 3) continue;
+            const screen_t a = toViewport(poly[0].x, poly[0].y, poly[0].z, poly[0].w, frustum);
+            screen_t b = toViewport(poly[1].x, poly[1].y, poly[1].z, poly[1].w, frustum);
+            for(int k = 2; k < m; k++){
+                const screen_t c = toViewport(poly[k].x, poly[k].y, poly[k].z, poly[k].w, frustum);
+                bool swap;
+                if(facing<P::state::cull>(a, b, c, swap) && setupTriangle(a, swap ? c : b, swap ? b : c, w, h, t, samples)){
+                    if constexpr (P::varying)
+                        v = varyingPlanes(t, poly[0], poly[swap ? k : k-1], poly[swap ? k-1 : k], shading);
+                    emit(t, P::varying ? &v : nullptr, thread);
+                    kept++;
+                }
+                b = c;
+            }
+        }
+        return {kept, rejected, clipped};
+    }
+
+    // P and shading must be what the triangles were binned with
+    template<typename P, typename D>
+    occlusion_t raster(framebuffer_t& framebuffer, D& depthbuffer, const shading_t& shading){
+        TRACE_ZONE("raster");
+        const int count = tilesX * tilesY;
+        size_t hidden = 0, blocks = 0, fragments = 0, tested = 0;
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:hidden, blocks, fragments, tested)
+        for(int tile = 0; tile < count; tile++){
+            const int x0 = (tile % tilesX) * TILE, y0 = (tile / tilesX) * TILE;
+            const int x1 = std::min(x0 + TILE, framebuffer.w) - 1, y1 = std::min(y0 + TILE, framebuffer.h) - 1;
+            bool any = false;
+            for(size_t thread = 0; thread < bins.size() && !any; thread++) any = !bins[thread][tile].empty();
+            if(!any) continue;
+            TRACE_ZONE("raster tile");
+            framebuffer.touch(tile % tilesX, tile / tilesX);
+            depthbuffer.touch(tile % tilesX, tile / tilesX);
+
+            occlusion_t skipped;
+            for(size_t thread = 0; thread < bins.size(); thread++)
+                for(uint32_t i : bins[thread][tile])
+                    skipped += rasterRect<P>(triangles[thread][i], P::varying ? &varyings[thread][i] : nullptr, shading,
+                                          x0, y0, x1, y1, framebuffer, depthbuffer);
+            depthbuffer.hiz.resolve(tile % tilesX, tile / tilesX);
+            hidden += skipped.triangles;
+            blocks += skipped.blocks;
+            fragments += skipped.fragments;
+            tested += skipped.tested;
+        }
+        return {hidden, blocks, fragments, tested};
+    }
+};
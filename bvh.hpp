@@ -0,0 +1,249 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "clip.hpp"
+#include "geometry.hpp"
+#include "hiz.hpp"
+#include "trace.hpp"
+#include "vertexcache.hpp"
+
+// Bounding volume hierarchy over a mesh's faces, built once at load time.
+// Building reorders the faces into depth-first leaf order, tipsifies the faces
+// inside each leaf for vertex reuse (see vertexcache.hpp) and renumbers the
+// vertices by first use in that order, so every node, inner ones included,
+// covers one contiguous run of faces and (nearly) one contiguous run of
+// vertices. Culling can then hand whole runs to the vertex stage and binner,
+// whose gathers by index then mostly hit lines they just loaded.
+using bvhnode_t =
+struct bvhnode {
+    vec<float, 3> min, max;
+    uint32_t first, count;   // faces [first, first+count)
+    uint32_t vfirst, vlast;  // every vertex the faces use lies in [vfirst, vlast]
+    uint32_t right;          // second child, the first child directly follows; 0 for leaves
+};
+
+// six planes (a, b, c, d), inside where a*x + b*y + c*z + d >= 0
+using planes_t = std::array<vec<float, 4>, 6>;
+
+// Planes of the view volume in the space mvp transforms from (Gribb/Hartmann).
+// Near and far are taken on w, which holds the view distance for both projections.
+inline planes_t frustumPlanes(const mat<float, 4, 4>& mvp, float nearZ, float farZ){
+    const vec<float, 4> r0 = mvp[0], r1 = mvp[1], r3 = mvp[3];
+    const vec<float, 4> n = {0.0f, 0.0f, 0.0f, nearZ}, f = {0.0f, 0.0f, 0.0f, farZ};
+    return {r3 + r0, r3 - r0, r3 + r1, r3 - r1, r3 - n, f - r3};
+}
+
+using bvh_t =
+struct bvh {
+    static constexpr uint32_t LEAF = 32; // faces per leaf
+
+    std::vector<bvhnode_t> nodes;
+
+    // faces are 1-based indices into vertices, both are reordered in place;
+    // returns each new vertex's old (0-based) index so callers can follow with
+    // whatever else is stored per vertex
+    std::vector<uint32_t> build(std::vector<vec<float, 3>>& vertices, std::vector<vec<uint32_t, 3>>& faces){
+        nodes.clear();
+        std::vector<uint32_t> origin(vertices.size());
+        std::iota(origin.begin(), origin.end(), 0u);
+        if(faces.empty()) return origin;
+        std::vector<vec<float, 3>> centroid(faces.size());
+        for(size_t i = 0; i < faces.size(); i++)
+            centroid[i] = (vertices[faces[i][0]-1] + vertices[faces[i][1]-1] + vertices[faces[i][2]-1]) * (1.0f / 3.0f);
+
+        std::vector<uint32_t> order(faces.size());
+        std::iota(order.begin(), order.end(), 0u);
+        nodes.reserve(2 * faces.size() / LEAF + 1);
+        split(order, centroid, 0, static_cast<uint32_t>(faces.size()));
+
+        std::vector<vec<uint32_t, 3>> sorted(faces.size());
+        for(size_t i = 0; i < faces.size(); i++) sorted[i] = faces[order[i]];
+        faces.swap(sorted);
+
+        // leaves in depth-first order, so the simulated cache runs on from one into the next
+        std::vector<uint64_t> stamp(vertices.size() + 1, 0);
+        uint64_t time = VERTEX_CACHE + 1;
+        for(const bvhnode_t& node : nodes)
+            if(!node.right) tipsify(faces, node.first, node.first + node.count, stamp, time);
+
+        // renumber vertices by first use; unreferenced ones go last
+        std::vector<uint32_t> remap(vertices.size() + 1, 0);
+        std::vector<vec<float, 3>> renumbered;
+        renumbered.reserve(vertices.size());
+        origin.clear();
+        for(auto& f : faces)
+            for(size_t k = 0; k < 3; k++){
+                uint32_t& r = remap[f[k]];
+                if(!r){
+                    renumbered.push_back(vertices[f[k]-1]);
+                    origin.push_back(f[k]-1);
+                    r = static_cast<uint32_t>(renumbered.size());
+                }
+                f[k] = r;
+            }
+        for(size_t v = 1; v <= vertices.size(); v++)
+            if(!remap[v]){
+                renumbered.push_back(vertices[v-1]);
+                origin.push_back(static_cast<uint32_t>(v-1));
+            }
+        vertices.swap(renumbered);
+
+        bounds(0, vertices, faces);
+        return origin;
+    }
+
+    struct result {
+        std::vector<vec<uint32_t, 2>> faces;    // [first, first+count) runs
+        std::vector<vec<uint32_t, 2>> vertices; // [first, last] runs, merged, ascending
+        size_t culled = 0;                      // faces in rejected subtrees
+    };
+
+    // Walks the tree against the planes; subtrees fully inside are taken whole.
+    // Runs come out roughly front to back.
+    void cull(const planes_t& planes, result& out) const {
+        TRACE_ZONE("cull");
+        out.faces.clear();
+        out.vertices.clear();
+        out.culled = 0;
+        if(nodes.empty()) return;
+
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while(top){
+            const bvhnode_t& node = nodes[stack[--top]];
+            bool inside = true, outside = false;
+            for(const auto& p : planes){
+                // nearest and farthest box corners along the plane normal
+                float far = p[3], near = p[3];
+                for(size_t k = 0; k < 3; k++){
+                    far  += p[k] * (p[k] >= 0.0f ? node.max[k] : node.min[k]);
+                    near += p[k] * (p[k] >= 0.0f ? node.min[k] : node.max[k]);
+                }
+                if(far < 0.0f){ outside = true; break; }
+                if(near < 0.0f) inside = false;
+            }
+            if(outside){ out.culled += node.count; continue; }
+            if(inside || !node.right){
+                append(out.faces, node.first, node.first + node.count);
+                out.vertices.push_back({node.vfirst, node.vlast});
+                continue;
+            }
+            // nearer child first, by w (the near plane's normal), so the hierarchical
+            // z sees occluders before what they hide
+            const uint32_t left = static_cast<uint32_t>(&node - nodes.data()) + 1;
+            const bool flip = distance(planes[4], nodes[node.right]) < distance(planes[4], nodes[left]);
+            stack[top++] = flip ? left : node.right;
+            stack[top++] = flip ? node.right : left;
+        }
+
+        std::sort(out.vertices.begin(), out.vertices.end(),
+                  [](const auto& a, const auto& b){ return a[0] < b[0]; });
+        size_t m = 0;
+        for(const auto& r : out.vertices){
+            if(m && r[0] <= out.vertices[m-1][1] + 1) out.vertices[m-1][1] = std::max(out.vertices[m-1][1], r[1]);
+            else out.vertices[m++] = r;
+        }
+        out.vertices.resize(m);
+    }
+
+private:
+    static float distance(const vec<float, 4>& p, const bvhnode_t& node){
+        return p[0] * (node.min[0] + node.max[0]) + p[1] * (node.min[1] + node.max[1]) + p[2] * (node.min[2] + node.max[2]);
+    }
+
+    static void append(std::vector<vec<uint32_t, 2>>& runs, uint32_t first, uint32_t end){
+        if(!runs.empty() && runs.back()[1] == first) runs.back()[1] = end;
+        else runs.push_back({first, end});
+    }
+
+    // median split on the longest centroid axis; returns the node's index
+    uint32_t split(std::vector<uint32_t>& order, const std::vector<vec<float, 3>>& centroid, uint32_t first, uint32_t count){
+        const uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back({{}, {}, first, count, 0, 0, 0});
+        if(count <= LEAF) return index;
+
+        vec<float, 3> lo = centroid[order[first]], hi = lo;
+        for(uint32_t i = first; i < first + count; i++)
+            for(size_t k = 0; k < 3; k++){
+                lo[k] = std::min(lo[k], centroid[order[i]][k]);
+                hi[k] = std::max(hi[k], centroid[order[i]][k]);
+            }
+        const vec<float, 3> extent = hi - lo;
+        const size_t axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+
+        const uint32_t half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                         [&](uint32_t a, uint32_t b){ return centroid[a][axis] < centroid[b][axis]; });
+        split(order, centroid, first, half);
+        const uint32_t right = split(order, centroid, first + half, count - half);
+        nodes[index].right = right;
+        return index;
+    }
+
+    // fills in boxes and vertex runs bottom-up
+    void bounds(uint32_t index, const std::vector<vec<float, 3>>& vertices, const std::vector<vec<uint32_t, 3>>& faces){
+        bvhnode_t& node = nodes[index];
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        vec<float, 3> lo = {inf, inf, inf}, hi = {-inf, -inf, -inf};
+        uint32_t vfirst = std::numeric_limits<uint32_t>::max(), vlast = 0;
+        if(!node.right){
+            for(uint32_t i = node.first; i < node.first + node.count; i++)
+                for(size_t k = 0; k < 3; k++){
+                    const size_t v = faces[i][k] - 1;
+                    for(size_t a = 0; a < 3; a++){
+                        lo[a] = std::min(lo[a], vertices[v][a]);
+                        hi[a] = std::max(hi[a], vertices[v][a]);
+                    }
+                    vfirst = std::min(vfirst, static_cast<uint32_t>(v));
+                    vlast = std::max(vlast, static_cast<uint32_t>(v));
+                }
+        } else {
+            for(uint32_t child : {index + 1, node.right}){
+                bounds(child, vertices, faces);
+                const bvhnode_t& c = nodes[child];
+                for(size_t a = 0; a < 3; a++){
+                    lo[a] = std::min(lo[a], c.min[a]);
+                    hi[a] = std::max(hi[a], c.max[a]);
+                }
+                vfirst = std::min(vfirst, c.vfirst);
+                vlast = std::max(vlast, c.vlast);
+            }
+        }
+        node.min = lo;
+        node.max = hi;
+        node.vfirst = vfirst;
+        node.vlast = vlast;
+    }
+};
+
+// Hierarchical z query for a node: true when the screen rect its box projects to
+// is already covered by nearer depth than the box's nearest corner. Boxes that
+// reach behind the near plane never count as occluded.
+template<typename D>
+inline bool occluded(const bvhnode_t& node, const mat<float, 4, 4>& mvp, const frustum_t& f, const hiz_t& hiz){
+    if(!hiz.enabled) return false;
+    int xmin = std::numeric_limits<int>::max(), ymin = xmin, xmax = std::numeric_limits<int>::min(), ymax = xmax;
+    float nearest = std::numeric_limits<float>::infinity();
+    for(int i = 0; i < 8; i++){
+        const vec<float, 4> p = {i & 1 ? node.max[0] : node.min[0], i & 2 ? node.max[1] : node.min[1],
+                                 i & 4 ? node.max[2] : node.min[2], 1.0f};
+        const float w = mvp[3][0]*p[0] + mvp[3][1]*p[1] + mvp[3][2]*p[2] + mvp[3][3];
+        if(w < f.nearZ) return false;
+        const screen_t s = toViewport(mvp[0][0]*p[0] + mvp[0][1]*p[1] + mvp[0][2]*p[2] + mvp[0][3],
+                                      mvp[1][0]*p[0] + mvp[1][1]*p[1] + mvp[1][2]*p[2] + mvp[1][3],
+                                      mvp[2][0]*p[0] + mvp[2][1]*p[1] + mvp[2][2]*p[2] + mvp[2][3], w, f);
+        xmin = std::min(xmin, s.x >> SUBPIXEL_BITS); xmax = std::max(xmax, s.x >> SUBPIXEL_BITS);
+        ymin = std::min(ymin, s.y >> SUBPIXEL_BITS); ymax = std::max(ymax, s.y >> SUBPIXEL_BITS);
+        nearest = std::min(nearest, hiz_t::key<D>(s.z));
+    }
+    xmin = std::max(xmin, 0); xmax = std::min(xmax, static_cast<int>(f.fw) - 1);
+    ymin = std::max(ymin, 0); ymax = std::min(ymax, static_cast<int>(f.fh) - 1);
+    if(xmin > xmax || ymin > ymax) return false; // off screen is the frustum test's call
+    return hiz.occluded(xmin, ymin, xmax, ymax, nearest);
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+#include "raster.hpp"
+
+// Screen-space guard band in pixels on each side of the viewport. Triangles that
+// stay inside it skip clipping entirely and let the rasterizer's bounding box
+// do the scissoring; it is sized so edge function rows (see edge_t) still fit
+// in 32 bits at 4K: they reach 32 * (w + 2*GUARD) * (h + 2*GUARD).
+constexpr int GUARD = 2048;
+
+// outcode bits: the low six test the real frustum (used for trivial reject),
+// the high four the guard band (used to decide whether clipping is needed)
+enum : uint16_t {
+    clipLeft = 1 << 0, clipRight = 1 << 1, clipBottom = 1 << 2, clipTop = 1 << 3,
+    clipNear = 1 << 4, clipFar = 1 << 5,
+    guardLeft = 1 << 6, guardRight = 1 << 7, guardBottom = 1 << 8, guardTop = 1 << 9,
+    clipFrustum = 0x3f,
+    clipNeeded = clipNear | guardLeft | guardRight | guardBottom | guardTop,
+};
+
+// Clip volume for the current viewport. Both projections in updateMVP put the
+// view distance in w, so near/far are tested on w whichever way depth runs.
+using frustum_t =
+struct frustum {
+    float nearZ, farZ;
+    float gx, gy;   // guard band half extents in ndc units
+    float fw, fh;   // viewport size in pixels
+
+    frustum(int width, int height, float nearZ, float farZ)
+        : nearZ(nearZ), farZ(farZ),
+          gx(1.0f + 2.0f * GUARD / static_cast<float>(width)),
+          gy(1.0f + 2.0f * GUARD / static_cast<float>(height)),
+          fw(static_cast<float>(width)), fh(static_cast<float>(height)) {}
+
+    uint16_t code(float x, float y, float w) const {
+        uint16_t c = 0;
+        c |= x < -w ? clipLeft : 0;
+        c |= x >  w ? clipRight : 0;
+        c |= y < -w ? clipBottom : 0;
+        c |= y >  w ? clipTop : 0;
+        c |= w < nearZ ? clipNear : 0;
+        c |= w > farZ ? clipFar : 0;
+        c |= x < -gx*w ? guardLeft : 0;
+        c |= x >  gx*w ? guardRight : 0;
+        c |= y < -gy*w ? guardBottom : 0;
+        c |= y >  gy*w ? guardTop : 0;
+        return c;
+    }
+};
+
+// floor without a libm call so the vertex loop still vectorizes; the clamp keeps
+// the conversion defined for vertices near the eye, which get clipped anyway
+inline int32_t floorToInt(float v){
+    v = std::min(std::max(v, -1e9f), 1e9f);
+    const int32_t t = static_cast<int32_t>(v);
+    return t - (static_cast<float>(t) > v);
+}
+
+// clip space to viewport: (ndc*0.5+0.5)*size, y flipped for screen coords,
+// rounded to the nearest subpixel
+inline screen_t toViewport(float x, float y, float z, float w, const frustum_t& f){
+    return {
+        floorToInt((x / w * 0.5f + 0.5f) * f.fw * SUBPIXEL + 0.5f),
+        floorToInt((1.0f - (y / w * 0.5f + 0.5f)) * f.fh * SUBPIXEL + 0.5f),
+        z / w,
+    };
+}
+
+// Clip-space position plus the shaded path's attributes (varyings after varW,
+// not yet over w); attributes are linear in clip space, so clipping just lerps them.
+constexpr int ATTRIBUTES = VARYINGS - 1;
+
+using clipvert_t =
+struct clipvert {
+    float x, y, z, w;
+    float attr[ATTRIBUTES] = {};
+};
+
+// Sutherland-Hodgman against the near plane and whichever guard band planes the
+// triangle crosses. Writes the clipped convex polygon to out and returns its
+// vertex count (0 when nothing is left); it's at most 3 + one per plane.
+inline int clipPolygon(const clipvert_t in[3], uint16_t planes, const frustum_t& f, clipvert_t out[8]){
+    clipvert_t buf[2][8];
+    int n = 3;
+    for(int i = 0; i < 3; i++) buf[0][i] = in[i];
+    int cur = 0;
+
+    for(int plane = 0; plane < 5; plane++){
+        static constexpr uint16_t bits[5] = {clipNear, guardLeft, guardRight, guardBottom, guardTop};
+        if(!(planes & bits[plane])) continue;
+        // signed distance, inside when >= 0
+        auto dist = [&](const clipvert_t& v){
+            switch(plane){
+                case 0:  return v.w - f.nearZ;
+                case 1:  return f.gx*v.w + v.x;
+                case 2:  return f.gx*v.w - v.x;
+                case 3:  return f.gy*v.w + v.y;
+                default: return f.gy*v.w - v.y;
+            }
+        };
+        const clipvert_t* src = buf[cur];
+        clipvert_t* dst = buf[cur ^ 1];
+        int m = 0;
+        for(int i = 0; i < n; i++){
+            const clipvert_t& a = src[i];
+            const clipvert_t& b = src[(i + 1) % n];
+            const float da = dist(a), db = dist(b);
+            if(da >= 0) dst[m++] = a;
+            if((da >= 0) != (db >= 0)){
+                const float t = da / (da - db);
+                clipvert_t& v = dst[m++];
+                v = {a.x + (b.x-a.x)*t, a.y + (b.y-a.y)*t, a.z + (b.z-a.z)*t, a.w + (b.w-a.w)*t};
+                for(int k = 0; k < ATTRIBUTES; k++) v.attr[k] = a.attr[k] + (b.attr[k]-a.attr[k])*t;
+            }
+        }
+        n = m;
+        cur ^= 1;
+        if(n < 3) return 0;
+    }
+    for(int i = 0; i < n; i++) out[i] = buf[cur][i];
+    return n;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "hiz.hpp"
+
+// Single-channel depth target. Depth arrives from the rasterizer as a float in
+// [0,1]; integer formats store it as unorm (16 bits for uint16_t, 24 bits like
+// D24 for uint32_t). Reversed targets expect a reversed projection (near = 1,
+// far = 0), which keeps float precision where perspective depth bunches up.
+// The target carries its hierarchical Z so clearing one always clears both.
+// Multisampled targets keep one depth per sample: row y holds samples rows,
+// sample s of pixel (x, y) at at(x, y)[s*pitch]. Storage is linear or tiled
+// like the framebuffer's, see pixelOffset.
+// Clears are lazy per tile like the framebuffer's; depth is never presented, so
+// untouched tiles need no resolve and get() just reports them as far.
+template<typename T, bool Reversed = false> struct depthbuffer {
+    using value_type = T;
+    static constexpr bool reversed = Reversed;
+    static constexpr bool integer = std::is_integral_v<T>;
+    static constexpr uint32_t scale = sizeof(T) == 2 ? 0xFFFFu : 0xFFFFFFu;
+    static constexpr T far = reversed ? T{0} : (integer ? static_cast<T>(scale) : T{1});
+
+    static_assert(std::is_same_v<T, uint16_t> || std::is_same_v<T, uint32_t> || std::is_same_v<T, float>);
+
+    depthbuffer(int w, int h, int samples = 1, bool tiled = false) : w(w), h(h), samples(samples), tiled(tiled) {
+        hiz.resize(w, h);
+        tiles.resize(w, h);
+        allocate();
+    }
+
+    static T quantize(float z){
+        z = std::clamp(z, 0.0f, 1.0f);
+        if constexpr (integer) return static_cast<T>(z * static_cast<float>(scale));
+        else return z;
+    }
+    static bool test(T z, T stored){ return reversed ? z > stored : z < stored; }
+
+    // unchecked pointer to pixel (x, y)'s first sample, contiguous to the end of the tile's row
+    T* at(int x, int y){ return data.data() + pixelOffset(x, y, pitch, samples, tiled, tiles.tilesX); }
+    // first sample's depth
+    T get(int x, int y) const {
+        if (x<0 || y<0 || x>=w || y>=h) return far;
+        if (tiles.state[(y / TILE) * tiles.tilesX + x / TILE] != tileclear_t::dirty) return far;
+        return data[pixelOffset(x, y, pitch, samples, tiled, tiles.tilesX)];
+    }
+    // bypasses the hierarchical Z, only meant for writing nearer values; every sample
+    void set(int x, int y, T z){
+        if (x<0 || y<0 || x>=w || y>=h) return;
+        touch(x / TILE, y / TILE);
+        for(int s = 0; s < samples; s++) at(x, y)[s*pitch] = z;
+    }
+    // as framebuffer::resize, storage is kept and every tile owes far afterwards
+    void resize(int nw, int nh){
+        if(nw == w && nh == h) return;
+        w = nw;
+        h = nh;
+        hiz.resize(w, h);
+        tiles.resize(w, h);
+        allocate();
+        tiles.clear(true);
+    }
+    void clear(){
+        tiles.clear(false);
+        hiz.clear();
+    }
+    // the tile is about to be drawn into
+    void touch(int tx, int ty){
+        if(!tiles.touch(tx, ty)) return;
+        const int x0 = tx * TILE, n = std::min(x0 + TILE, w) - x0, y1 = std::min((ty + 1) * TILE, h);
+        for(int y = ty * TILE; y < y1; y++)
+            for(int s = 0; s < samples; s++) std::fill(at(x0, y) + s*pitch, at(x0, y) + s*pitch + n, far);
+    }
+    // eager full clear with streaming stores
+    void fill(){
+        streamFill(data.data(), data.size(), far);
+        streamFence();
+        std::fill(tiles.state.begin(), tiles.state.end(), tileclear_t::clean);
+        hiz.clear();
+    }
+
+    int w;
+    int h;
+    int samples; // per pixel, 1 or 4
+    bool tiled;  // storage layout, see pixelOffset
+    int pitch;   // elements per row of one sample
+    std::vector<T, aligned<T>> data;
+    tileclear_t tiles;
+    hiz_t hiz;
+
+private:
+    // Linear rows are padded to whole cache lines so tiles never share a line
+    // across rows; tiled storage is whole tiles, TILE elements a row.
+    void allocate(){
+        pitch = tiled ? TILE : ((w * int(sizeof(T)) + 63) & ~63) / int(sizeof(T));
+        const size_t rows = tiled ? static_cast<size_t>(tiles.tilesX) * tiles.tilesY * TILE : static_cast<size_t>(h);
+        data.resize(pitch * rows * samples, far);
+    }
+};
+
+using depth16_t  = depthbuffer<uint16_t>;
+using depth24_t  = depthbuffer<uint32_t>;
+using depthf_t   = depthbuffer<float>;
+using depthrf_t  = depthbuffer<float, true>;
@@ -1,38 +1,317 @@
 #pragma once
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <new>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "geometry.hpp"
 
 using color_t = vec<uint8_t, 4>;
 
+// cache-line aligned storage; with rows padded to whole lines (see the targets'
+// allocate) tiles owned by different threads never share a line
+template<typename T, std::size_t A = 64> struct aligned {
+    using value_type = T;
+    template<typename U> struct rebind { using other = aligned<U, A>; };
+    aligned() = default;
+    template<typename U> aligned(const aligned<U, A>&) noexcept {}
+    T* allocate(std::size_t n){ return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{A})); }
+    void deallocate(T* p, std::size_t){ ::operator delete(p, std::align_val_t{A}); }
+    template<typename U> bool operator==(const aligned<U, A>&) const noexcept { return true; }
+};
+
+// Screen tiles, the unit of binning, lazy clears and the coarse hiz level.
+constexpr int TILE = 64;
+
+// Fills count elements from p with value using non-temporal stores, for clears
+// whose lines won't be read again soon and would only evict what will be.
+// Follow a batch of them with streamFence() before anything else reads the memory.
+template<typename T>
+inline void streamFill(T* p, size_t count, T value){
+#if defined(__SSE2__)
+    for(; count && (reinterpret_cast<uintptr_t>(p) & 15); count--) *p++ = value;
+    T lanes[16 / sizeof(T)];
+    std::fill(std::begin(lanes), std::end(lanes), value);
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+    constexpr size_t N = 16 / sizeof(T);
+    for(; count >= 4 * N; count -= 4 * N, p += 4 * N){
+        __m128i* d = reinterpret_cast<__m128i*>(p);
+        _mm_stream_si128(d, v); _mm_stream_si128(d + 1, v); _mm_stream_si128(d + 2, v); _mm_stream_si128(d + 3, v);
+    }
+    for(; count >= N; count -= N, p += N) _mm_stream_si128(reinterpret_cast<__m128i*>(p), v);
+#endif
+    std::fill(p, p + count, value);
+}
+
+inline void streamFence(){
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Copies count pixels from in to out, streaming them out 16 bytes at a time
+// once out is aligned; in can be anywhere. Same fence rule as streamFill.
+inline void streamCopy(uint32_t* out, const uint32_t* in, size_t count){
+#if defined(__SSE2__)
+    for(; count && (reinterpret_cast<uintptr_t>(out) & 15); count--) *out++ = *in++;
+    for(; count >= 16; count -= 16, in += 16, out += 16){
+        const __m128i* s = reinterpret_cast<const __m128i*>(in);
+        __m128i* d = reinterpret_cast<__m128i*>(out);
+        const __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1);
+        const __m128i c = _mm_loadu_si128(s + 2), e = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, a); _mm_stream_si128(d + 1, b); _mm_stream_si128(d + 2, c); _mm_stream_si128(d + 3, e);
+    }
+    for(; count >= 4; count -= 4, in += 4, out += 4)
+        _mm_stream_si128(reinterpret_cast<__m128i*>(out), _mm_loadu_si128(reinterpret_cast<const __m128i*>(in)));
+#endif
+    std::copy(in, in + count, out);
+}
+
+// Lazy clear bookkeeping for a buffer cut into TILE x TILE tiles. Clearing only
+// flags the tiles that were drawn to; a tile is filled when it is next touched,
+// or at resolve if nothing touches it. Tiles still holding the clear value from
+// an earlier frame are left alone altogether.
+using tileclear_t =
+struct tileclear {
+    enum : uint8_t { clean, pending, dirty }; // holds the clear value, owes it, holds drawing
+
+    void resize(int w, int h){
+        tilesX = (w + TILE - 1) / TILE;
+        tilesY = (h + TILE - 1) / TILE;
+        state.assign(tilesX * tilesY, clean);
+    }
+    // a new clear value invalidates the clean tiles too
+    void clear(bool changed){
+        if(changed) std::fill(state.begin(), state.end(), pending);
+        else for(uint8_t& s : state) if(s == dirty) s = pending;
+    }
+    // the caller is about to draw into the tile; true when it must fill it first
+    bool touch(int tx, int ty){
+        uint8_t& s = state[ty * tilesX + tx];
+        const bool fill = s == pending;
+        s = dirty;
+        return fill;
+    }
+
+    int tilesX = 0, tilesY = 0;
+    std::vector<uint8_t> state;
+};
+
+// Where pixel (x, y) of a target sits, in elements, with planes rows stored per
+// pixel row (its samples). Linear targets store rows pitch apart. Tiled ones
+// store TILE x TILE tiles one after the other, tilesX to a row of tiles, each
+// like a linear target of pitch TILE: a bin the rasterizer works through then
+// lies in one stretch of memory (16 KB of color, 4 pages) instead of TILE rows
+// of the whole width apart, and since spans never leave their bin they stay
+// contiguous either way. Edge tiles are stored whole.
+inline size_t pixelOffset(int x, int y, int pitch, int planes, bool tiled, int tilesX){
+    if(!tiled) return static_cast<size_t>(y) * pitch * planes + x;
+    const size_t tile = static_cast<size_t>(y / TILE) * tilesX + x / TILE;
+    return (tile * TILE * TILE + (y % TILE) * TILE) * planes + x % TILE;
+}
+
+// RGBA32 color target. clear() is lazy (see tileclear_t): the binner touches each
+// tile before drawing into it, and resolve() must run before the pixels are read.
+//
+// With more than one sample per pixel the color stays compressed: a pixel whose
+// samples all got the same color keeps it in data alone, and only pixels an edge
+// crosses are expanded into per-sample colors. Sample s of row y sits in the
+// sample planes at row y * samples + s, the same layout the depth target uses;
+// resolve() averages expanded pixels back into data.
+//
+// Pixels are stored linear or tiled (see pixelOffset). A tiled target is
+// detiled by resolve() into a linear copy, image() is what gets presented.
 using framebuffer_t =
 struct framebuffer {
-    framebuffer(int w, int h) : w(w), h(h), data(w*h*bpp, 0) {
-        for (int j=0; j<h; j++)
-            for (int i=0; i<w; i++)
-                set(i, j, {});
+    framebuffer(int w, int h, int samples = 1, bool tiled = false) : w(w), h(h), samples(samples), tiled(tiled) {
+        tiles.resize(w, h);
+        allocate();
     }
     void set(int x, int y, const color_t& color){
         if (!data.size() || x<0 || y<0 || x>=w || y>=h) return;
-        memcpy(data.data()+(x+y*w)*bpp, color.data.data(), bpp);
+        touch(x / TILE, y / TILE);
+        memcpy(at(x, y), color.data.data(), bpp);
+        if(samples > 1) *expandedAt(x, y) = 0;
     }
     color_t get(int x, int y){
         if (!data.size() || x<0 || y<0 || x>=w || y>=h) return {0,0,0,0};
         color_t ret;
-        ret[0] = data[(x+y*w)*bpp+0];
-        ret[1] = data[(x+y*w)*bpp+1];
-        ret[2] = data[(x+y*w)*bpp+2];
-        ret[3] = data[(x+y*w)*bpp+3];
+        memcpy(ret.data.data(), at(x, y), bpp);
         return ret;
     }
-    void clear(uint8_t c = 0){ std::fill(data.begin(), data.end(), c); }
+    // Unchecked pointers to pixel (x, y) for span kernels; pixels are
+    // contiguous from there to the end of the tile's row. Sample s of the
+    // sample planes is s * pitch * bpp bytes further.
+    uint8_t* at(int x, int y){ return data.data() + pixelOffset(x, y, pitch, 1, tiled, tiles.tilesX) * bpp; }
+    const uint8_t* at(int x, int y) const { return data.data() + pixelOffset(x, y, pitch, 1, tiled, tiles.tilesX) * bpp; }
+    uint8_t* sampleAt(int x, int y){ return sampleData.data() + pixelOffset(x, y, pitch, samples, tiled, tiles.tilesX) * bpp; }
+    uint8_t* expandedAt(int x, int y){ return expanded.data() + pixelOffset(x, y, pitch, 1, tiled, tiles.tilesX); }
+    // the frame as linear RGBA32 rows of w pixels imagePitch() bytes apart, once resolved
+    const uint8_t* image() const { return tiled ? linear.data() : data.data(); }
+    int imagePitch() const { return (tiled ? w : pitch) * bpp; }
+    // Changes the size drawn at without giving back storage, so a resolution
+    // that drops and comes back up allocates nothing. Contents are lost: every
+    // tile owes the clear value afterwards.
+    void resize(int nw, int nh){
+        if(nw == w && nh == h) return;
+        w = nw;
+        h = nh;
+        tiles.resize(w, h);
+        allocate();
+        tiles.clear(true);
+    }
+    void clear(uint8_t c = 0){
+        const uint32_t v = c * 0x01010101u;
+        tiles.clear(v != value);
+        if(v != value) std::fill(shown.begin(), shown.end(), uint8_t{0});
+        value = v;
+    }
+
+    void touch(int tx, int ty){
+        if(tiles.touch(tx, ty)) fillTile(tx, ty, false);
+    }
+    // writes the clear value into tiles nothing drew to, then detiles
+    void resolve(){
+        if(std::all_of(tiles.state.begin(), tiles.state.end(), [](uint8_t s){ return s == tileclear_t::pending; }))
+            fill();
+        else {
+            for(int ty = 0; ty < tiles.tilesY; ty++)
+                for(int tx = 0; tx < tiles.tilesX; tx++){
+                    uint8_t& s = tiles.state[ty * tiles.tilesX + tx];
+                    if(s != tileclear_t::pending) continue;
+                    fillTile(tx, ty, true);
+                    s = tileclear_t::clean;
+                }
+            streamFence();
+        }
+        const int count = tiles.tilesX * tiles.tilesY;
+        // only tiles drawn to this frame can hold expanded pixels
+        if(samples > 1){
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int tile = 0; tile < count; tile++)
+                if(tiles.state[tile] == tileclear_t::dirty) resolveTile(tile % tiles.tilesX, tile / tiles.tilesX);
+        }
+        if(tiled) detile();
+    }
+    // eager full clear with streaming stores
+    void fill(){
+        streamFill(reinterpret_cast<uint32_t*>(data.data()), data.size() / bpp, value);
+        streamFence();
+        std::fill(tiles.state.begin(), tiles.state.end(), tileclear_t::clean);
+    }
 
     int w;
     int h;
+    int samples; // per pixel, 1 or 4
+    bool tiled;  // storage layout, see pixelOffset
+    int pitch;   // pixels per stored row: w rounded up to a cache line, or TILE when tiled
     int bpp = 4; // 4 bytes per pixel R, G, B, A
-    std::vector<uint8_t> data = {};
+    std::vector<uint8_t, aligned<uint8_t>> data = {};
+    std::vector<uint8_t, aligned<uint8_t>> sampleData; // per-sample colors of expanded pixels
+    std::vector<uint8_t, aligned<uint8_t>> expanded;   // per pixel, 1 when sampleData holds its colors
+    std::vector<uint8_t, aligned<uint8_t>> linear;     // detiled frame of a tiled target
+    std::vector<uint8_t> shown;                        // per tile, 1 when linear holds the clear value there
+    tileclear_t tiles;
+    uint32_t value = 0; // clear color, as stored
+
+private:
+    // Storage for the current size. Linear rows are padded to whole cache lines
+    // (16 pixels) as the depth target's are, so tiles never share a line across
+    // rows whatever width dynamic resolution picks; tiled storage is whole tiles.
+    void allocate(){
+        pitch = tiled ? TILE : (w + 15) & ~15;
+        const size_t area = tiled ? static_cast<size_t>(tiles.tilesX) * tiles.tilesY * TILE * TILE : static_cast<size_t>(pitch) * h;
+        data.resize(area * bpp);
+        if(samples > 1){
+            sampleData.resize(area * samples * bpp);
+            expanded.resize(area);
+        }
+        if(tiled){
+            linear.resize(static_cast<size_t>(w) * h * bpp);
+            shown.assign(tiles.tilesX * tiles.tilesY, 0);
+        }
+    }
+
+    // tiles filled on touch are drawn into right away and want to stay cached,
+    // tiles filled at resolve only get uploaded
+    void fillTile(int tx, int ty, bool stream){
+        const int x0 = tx * TILE, n = std::min(x0 + TILE, w) - x0, y1 = std::min((ty + 1) * TILE, h);
+        for(int y = ty * TILE; y < y1; y++){
+            uint32_t* p = reinterpret_cast<uint32_t*>(at(x0, y));
+            if(stream) streamFill(p, n, value);
+            else std::fill(p, p + n, value);
+            if(samples > 1) std::fill(expandedAt(x0, y), expandedAt(x0, y) + n, uint8_t{0});
+        }
+    }
+
+    // Tile rows into the linear image, streamed: only the upload reads it.
+    // Tiles holding the clear value are filled instead, and only once for as
+    // long as they keep holding it.
+    void detile(){
+        const int count = tiles.tilesX * tiles.tilesY;
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int tile = 0; tile < count; tile++){
+            const bool drawn = tiles.state[tile] == tileclear_t::dirty;
+            if(!drawn && shown[tile]) continue;
+            shown[tile] = !drawn;
+            const int x0 = (tile % tiles.tilesX) * TILE, ty = tile / tiles.tilesX;
+            const int n = std::min(x0 + TILE, w) - x0, y1 = std::min((ty + 1) * TILE, h);
+            for(int y = ty * TILE; y < y1; y++){
+                uint32_t* out = reinterpret_cast<uint32_t*>(linear.data()) + static_cast<size_t>(y) * w + x0;
+                if(drawn) streamCopy(out, reinterpret_cast<const uint32_t*>(at(x0, y)), n);
+                else streamFill(out, n, value);
+            }
+        }
+        streamFence();
+    }
+
+    // averages the samples of the tile's expanded pixels into their color,
+    // 4 pixels at a time where there are 4 left
+    void resolveTile(int tx, int ty){
+        const int x0 = tx * TILE, n = std::min(x0 + TILE, w) - x0, y1 = std::min((ty + 1) * TILE, h);
+        const size_t plane = pitch * bpp;
+        for(int y = ty * TILE; y < y1; y++){
+            const uint8_t* flags = expandedAt(x0, y);
+            const uint8_t* sample = sampleAt(x0, y);
+            uint8_t* out = at(x0, y);
+            int x = 0;
+#if defined(__SSE2__)
+            if(samples == 4){
+                const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+                for(; x + 4 <= n; x += 4){
+                    uint32_t f;
+                    memcpy(&f, flags + x, 4);
+                    if(!f) continue;
+                    const uint8_t* p = sample + x * bpp;
+                    __m128i lo = two, hi = two;
+                    for(int s = 0; s < 4; s++){
+                        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + s * plane));
+                        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+                    }
+                    const __m128i avg = _mm_packus_epi16(_mm_srli_epi16(lo, 2), _mm_srli_epi16(hi, 2));
+                    const __m128i bytes = _mm_cvtsi32_si128(static_cast<int>(f));
+                    const __m128i mask = _mm_cmpgt_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero), zero);
+                    __m128i* o = reinterpret_cast<__m128i*>(out + x * bpp);
+                    _mm_storeu_si128(o, _mm_or_si128(_mm_and_si128(mask, avg), _mm_andnot_si128(mask, _mm_loadu_si128(o))));
+                }
+            }
+#endif
+            for(; x < n; x++){
+                if(!flags[x]) continue;
+                for(int c = 0; c < bpp; c++){
+                    unsigned sum = 2;
+                    for(int s = 0; s < samples; s++) sum += sample[s*plane + x*bpp + c];
+                    out[x*bpp + c] = static_cast<uint8_t>(sum / samples);
+                }
+            }
+        }
+    }
 };
 
 constexpr color_t
@@ -5,6 +5,12 @@
 #include <concepts>
 #include <limits>
 #include <optional>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEOMETRY_X86 1
+#endif
 
 template<typename T>
 concept integer =
@@ -12,8 +18,14 @@ concept integer =
     !std::same_as<T, bool>)
     || std::floating_point<T>;
 
+// vec<float, 4> and mat<float, 4, 4> carry every vertex and the mvp, so they are
+// 16-byte aligned and their products go through SSE. The kernels only run when
+// the call is not being constant evaluated: constexpr matrices still fold.
+template<typename T, std::size_t N>
+inline constexpr bool packed = std::same_as<T, float> && N == 4;
+
 template<integer T, std::size_t N> struct vec{
-    std::array<T, N> data;
+    alignas(packed<T, N> ? 16 : alignof(std::array<T, N>)) std::array<T, N> data;
 
     constexpr const T& operator[](std::size_t n) const noexcept {
         return data[n];
@@ -51,10 +63,13 @@ template<integer T, std::size_t N> struct vec{
         return u;
     }
 
-    float length() const {
-        T sum{};
+    // integer vectors measure in double, floating ones in their own type
+    using length_t = std::conditional_t<std::floating_point<T>, T, double>;
+
+    length_t length() const {
+        length_t sum{};
         for(std::size_t i{0uz}; i < N; i++){
-            T x = (*this)[i];
+            length_t x = (*this)[i];
             sum += (x * x);
         }
         return std::sqrt(sum);
@@ -69,8 +84,7 @@ template<integer T, std::size_t N> struct vec{
         return dp;
     }
 
-    constexpr vec<T, 3> cross(const vec<T,3>& w) const noexcept {
-        if(N!=3) return vec<T, N>{};
+    constexpr vec<T, 3> cross(const vec<T,3>& w) const noexcept requires (N == 3) {
         vec<T, 3> cp = {
             (*this)[1]*w[2] - (*this)[2]*w[1],
             (*this)[2]*w[0] - (*this)[0]*w[2],
@@ -80,11 +94,14 @@ template<integer T, std::size_t N> struct vec{
     }
 
     double angle(const vec<T,N>& w) const {
-        return std::acos( std::clamp(this->dot(w) / (this->length() * w.length()), -1., 1.) );
+        const double c = static_cast<double>(this->dot(w)) / (static_cast<double>(this->length()) * w.length());
+        return std::acos( std::clamp(c, -1., 1.) );
     }
 };
 
 template<integer T, std::size_t m, std::size_t n> struct mat{
+    static constexpr bool square4 = packed<T, n> && m == 4;
+
     std::array<vec<T, n>, m> data;
 
     constexpr const vec<T, n>& operator[](std::size_t i) const noexcept{
@@ -112,6 +129,25 @@ template<integer T, std::size_t m, std::size_t n> struct mat{
     }
 
     constexpr vec<T, m> operator*(const vec<T, n>& v) const noexcept{
+#ifdef GEOMETRY_X86
+        if constexpr (square4)
+            if !consteval { return mulSSE(v); }
+#endif
+        return mulScalar(v);
+    }
+
+    template<std::size_t p>
+    constexpr mat<T, m, p> operator*(const mat<T, n, p>& b) const noexcept{
+#ifdef GEOMETRY_X86
+        if constexpr (square4 && p == 4)
+            if !consteval { return mulSSE(b); }
+#endif
+        return mulScalar(b);
+    }
+
+    // The products one by one; operator* picks. Both sum in the same order and
+    // never contract to fma, so they agree to the bit.
+    constexpr vec<T, m> mulScalar(const vec<T, n>& v) const noexcept{
         vec<T, m> u{};
         for(std::size_t i{0uz}; i < m; i++){
             u[i] = (*this)[i].dot(v);
@@ -120,7 +156,7 @@ template<integer T, std::size_t m, std::size_t n> struct mat{
     }
 
     template<std::size_t p>
-    constexpr mat<T, m, n> operator*(const mat<T, n, p>& b) const noexcept{
+    constexpr mat<T, m, p> mulScalar(const mat<T, n, p>& b) const noexcept{
         mat<T, m, p> c{};
         for(std::size_t i{0uz}; i < m; i++)
             for(std::size_t j{0uz}; j < p; j++){
@@ -132,6 +168,39 @@ template<integer T, std::size_t m, std::size_t n> struct mat{
         return c;
     }
 
+#ifdef GEOMETRY_X86
+    // columns times the broadcast components, so no horizontal adds
+    vec<T, 4> mulSSE(const vec<T, 4>& v) const noexcept requires square4 {
+        __m128 c0 = _mm_load_ps(&data[0][0]), c1 = _mm_load_ps(&data[1][0]);
+        __m128 c2 = _mm_load_ps(&data[2][0]), c3 = _mm_load_ps(&data[3][0]);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        const __m128 x = _mm_load_ps(&v[0]);
+        __m128 u = _mm_mul_ps(c0, _mm_shuffle_ps(x, x, 0x00));
+        u = _mm_add_ps(u, _mm_mul_ps(c1, _mm_shuffle_ps(x, x, 0x55)));
+        u = _mm_add_ps(u, _mm_mul_ps(c2, _mm_shuffle_ps(x, x, 0xAA)));
+        u = _mm_add_ps(u, _mm_mul_ps(c3, _mm_shuffle_ps(x, x, 0xFF)));
+        vec<T, 4> out;
+        _mm_store_ps(&out[0], u);
+        return out;
+    }
+
+    // row i of the product is row i of this weighting the rows of b
+    mat<T, 4, 4> mulSSE(const mat<T, 4, 4>& b) const noexcept requires square4 {
+        const __m128 b0 = _mm_load_ps(&b[0][0]), b1 = _mm_load_ps(&b[1][0]);
+        const __m128 b2 = _mm_load_ps(&b[2][0]), b3 = _mm_load_ps(&b[3][0]);
+        mat<T, 4, 4> c;
+        for(std::size_t i{0uz}; i < 4; i++){
+            const __m128 a = _mm_load_ps(&data[i][0]);
+            __m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b1));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xAA), b2));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xFF), b3));
+            _mm_store_ps(&c[i][0], r);
+        }
+        return c;
+    }
+#endif
+
     constexpr mat<T, n, m> transpose() const noexcept{
         mat<T, n, m> t{};
         for(std::size_t i{0uz}; i < m; i++)
@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "framebuffer.hpp"
+
+// Hierarchical Z: a conservative farthest depth per 8x8 pixel block, and above it
+// one per 64x64 tile (8x8 blocks). Anything whose nearest depth lies behind a
+// block's bound would fail the depth test on every pixel of that block, so the
+// rasterizer can drop it without touching the depth buffer.
+//
+// Depths are kept as keys that grow with distance whichever way the target runs
+// (z, or -z on reversed targets), so comparisons don't depend on the format.
+// A block's bound only ever moves nearer when it is covered completely, by one
+// triangle or by several between them (a quad's diagonal, say): it then becomes
+// the farthest depth those drew over the block, which the rasterizer pads by
+// the worst rounding the span kernels can do on the way. Partial covers are
+// kept as a mask of the block's pixels until they add up to all of them.
+using hiz_t =
+struct hiz {
+    static constexpr int BLOCK = 8;  // pixels per block side
+    static constexpr int COARSE = 8; // blocks per coarse tile side
+
+    template<typename D>
+    static float key(float z){ return D::reversed ? -z : z; }
+
+    void resize(int w, int h){
+        bw = (w + BLOCK - 1) / BLOCK;
+        bh = (h + BLOCK - 1) / BLOCK;
+        cw = (bw + COARSE - 1) / COARSE;
+        ch = (bh + COARSE - 1) / COARSE;
+        blocks.assign(bw * bh, empty);
+        coarse.assign(cw * ch, empty);
+        masks.assign(bw * bh, 0);
+        partial.assign(bw * bh, -empty);
+    }
+    void clear(){
+        std::fill(blocks.begin(), blocks.end(), empty);
+        std::fill(coarse.begin(), coarse.end(), empty);
+        std::fill(masks.begin(), masks.end(), uint64_t{0});
+        std::fill(partial.begin(), partial.end(), -empty);
+    }
+
+    float& block(int bx, int by){ return blocks[by * bw + bx]; }
+    float block(int bx, int by) const { return blocks[by * bw + bx]; }
+
+    // a triangle covering every pixel of the block has been drawn, no depth it
+    // wrote there lies beyond farthest
+    void cover(int bx, int by, float farthest){
+        float& b = block(bx, by);
+        b = std::min(b, farthest);
+    }
+
+    // a triangle covering the block's pixels in mask (bit y*BLOCK+x) has been
+    // drawn; once the partial covers add up to the whole block the farthest of
+    // them bounds it, and the next ones start over
+    void cover(int bx, int by, uint64_t mask, float farthest){
+        const int i = by * bw + bx;
+        masks[i] |= mask;
+        partial[i] = std::max(partial[i], farthest);
+        if(masks[i] != ~uint64_t{0}) return;
+        blocks[i] = std::min(blocks[i], partial[i]);
+        masks[i] = 0;
+        partial[i] = -empty;
+    }
+
+    // depth in the inclusive pixel rect may have moved farther, its blocks bound nothing now
+    void forget(int x0, int y0, int x1, int y1){
+        for(int by = y0 / BLOCK; by <= y1 / BLOCK; by++)
+            for(int bx = x0 / BLOCK; bx <= x1 / BLOCK; bx++){
+                block(bx, by) = empty;
+                masks[by * bw + bx] = 0;
+                partial[by * bw + bx] = -empty;
+            }
+    }
+
+    // refreshes one coarse tile from its blocks; the binner calls this after
+    // finishing a tile, which is also what keeps the coarse level race free
+    void resolve(int cx, int cy){
+        float farthest = -std::numeric_limits<float>::infinity();
+        for(int by = cy * COARSE; by < std::min((cy + 1) * COARSE, bh); by++)
+            for(int bx = cx * COARSE; bx < std::min((cx + 1) * COARSE, bw); bx++)
+                farthest = std::max(farthest, block(bx, by));
+        coarse[cy * cw + cx] = farthest;
+    }
+
+    // true when everything in the inclusive pixel rect [x0,x1]x[y0,y1] is already
+    // nearer than `nearest` (a key); coarse tiles the rect spans whole are read
+    // from the coarse level, the rest block by block
+    bool occluded(int x0, int y0, int x1, int y1, float nearest) const {
+        const int bx0 = x0 / BLOCK, by0 = y0 / BLOCK, bx1 = x1 / BLOCK, by1 = y1 / BLOCK;
+        if(bx1 - bx0 < COARSE && by1 - by0 < COARSE){
+            // no bigger than a coarse tile, the blocks are quicker than the bookkeeping
+            for(int by = by0; by <= by1; by++)
+                for(int bx = bx0; bx <= bx1; bx++)
+                    if(nearest <= block(bx, by)) return false;
+            return true;
+        }
+        for(int cy = by0 / COARSE; cy <= by1 / COARSE; cy++)
+            for(int cx = bx0 / COARSE; cx <= bx1 / COARSE; cx++){
+                const int sx0 = std::max(bx0, cx * COARSE), sx1 = std::min(bx1, (cx + 1) * COARSE - 1);
+                const int sy0 = std::max(by0, cy * COARSE), sy1 = std::min(by1, (cy + 1) * COARSE - 1);
+                const bool whole = sx0 == cx * COARSE && sy0 == cy * COARSE &&
+                                   sx1 == std::min((cx + 1) * COARSE, bw) - 1 && sy1 == std::min((cy + 1) * COARSE, bh) - 1;
+                if(whole){
+                    if(nearest <= coarse[cy * cw + cx]) return false;
+                    continue;
+                }
+                for(int by = sy0; by <= sy1; by++)
+                    for(int bx = sx0; bx <= sx1; bx++)
+                        if(nearest <= block(bx, by)) return false;
+            }
+        return true;
+    }
+
+    static constexpr float empty = std::numeric_limits<float>::infinity();
+
+    // off, the rasterizer neither reads nor maintains it
+    bool enabled = true;
+
+    int bw = 0, bh = 0; // blocks per row / column
+    int cw = 0, ch = 0; // coarse tiles per row / column
+    std::vector<float, aligned<float>> blocks, coarse;
+    std::vector<uint64_t, aligned<uint64_t>> masks; // per block, pixels partial covers reached so far
+    std::vector<float, aligned<float>> partial;     // per block, the farthest of those covers
+};
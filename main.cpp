@@ -1,36 +1,96 @@
+#ifndef HEADLESS
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mouse.h>
+#endif
 
 #include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <numbers>
 #include <omp.h>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#ifndef HEADLESS
 #include <SDL2/SDL_main.h>
+#endif
+#include "bench.hpp"
+#include "binner.hpp"
+#include "clip.hpp"
+#include "depthbuffer.hpp"
 #include "framebuffer.hpp"
 #include "geometry.hpp"
+#include "mathbench.hpp"
 #include "model.hpp"
+#include "perfcounters.hpp"
+#include "pipeline.hpp"
+#include "raster.hpp"
+#include "resolution.hpp"
+#include "scene.hpp"
+#include "trace.hpp"
+#include "vertex.hpp"
+#include "visibility.hpp"
 
 constexpr const char* PATH = "../assets/demon.obj";
 //constexpr const char* PATH = "../assets/weep.obj";
 //constexpr const char* PATH = "../assets/dionysos.obj";
 //constexpr const char* PATH = "../assets/hunter.obj";
 constexpr double aS = 1.0/1000.0;
+
+// command line, shared by the windowed and headless builds
+using options_t =
+struct options {
+    int frames = 300;
+    bool sweep = false;
+    bool cache = true;
+    bool hiz = true;            // hierarchical z occlusion culling
+    bool math = false;          // run the geometry micro-benchmark instead of rendering
+    int msaa = 1;               // samples per pixel, 1 or 4
+    std::string shade = "textured"; // pipeline: depth (z only), flat (gray by depth), lit or textured
+    int latency = 2;            // frames in flight in the windowed build, 1 renders and presents in turn
+    double fps = 0.0;           // frame rate cap in the windowed build, 0 runs uncapped
+    double budget = -1.0;       // ms of render time the resolution scaler holds frames to, 0 renders
+                                // at full size, negative follows --fps (windowed) or is off (headless)
+    std::string dump;
+    std::string depth = "rf32"; // u16, u24, f32 or rf32 (reversed float)
+    double load = 0.0;          // model load time, ms
+    float orbit = 1.0f;         // benchmark orbit radius multiplier, for far away levels of detail
+    int instances = 1;          // copies of the model, on a grid
+    bool occluder = false;      // a solid pillar in the grid's center cell, the instances around it
+    uint32_t model = 0;         // the obj's index in the scene, for the report
+    bool tiled = false;         // color and depth stored tile by tile, see pixelOffset
+};
+
+// the pipelines drawScene can run, see shader.hpp
+enum class program_t { depth, flat, lit, textured };
+
+// an instance as one frame draws it
+using draw_t =
+struct draw {
+    uint32_t instance, model, level;
+    float distance; // to the bounding box center, along the view
+    mat<float, 4, 4> mvp;
+};
+
 using state_t =
 struct state { 
     uint16_t width = 640;
     uint16_t height = 480;
-    uint16_t depth = 255;
+    bool reversedZ = false; // projection maps near to 1 and far to 0
+    program_t program = program_t::textured;
+    int lod = -1;           // level of detail to draw, -1 picks one by screen size
+#ifndef HEADLESS
     SDL_Window* sdlWindow;
     SDL_Renderer* sdlRenderer;
     SDL_Texture* sdlTexture;
+#endif
 
     struct {
         bool running = true;
@@ -53,15 +113,31 @@ struct state {
         vec<float, 3> up = {0.0f, 0.0f, 1.0f};
         vec<float, 3> right = {1.0f, 0.0f, 0.0f};
         vec<float, 2> orientation{};
+        float nearZ = 0.1f;
+        float farZ = 100.0f;
     } camera;
 
-    mat<float, 4, 4> mvp = {};
+    mat<float, 4, 4> viewproj = {}; // world to clip, instances bring their model matrices
+    bool batching = true;           // one draw per mesh rather than per instance
+    bool deferred = false;          // shade through a visibility buffer
 
     struct {
-        std::chrono::time_point<std::chrono::high_resolution_clock> start<%%>, end<%%>;
-        std::chrono::milliseconds delta<%%>;
-        double frameTime = 1000.0/60.0; // 60 fps
+        std::chrono::steady_clock::time_point start<%%>;   // last present
+        std::chrono::duration<double, std::milli> delta<%%>; // interval between the last two presents
+        double frameTime = 0.0; // ms, paced to when non-zero
     } time;
+
+    stats_t stats;
+    std::vector<draw_t> draws; // per-frame instances with their level of detail
+    struct {
+        std::vector<instancerun_t> faces, vertices;  // per draw
+        std::vector<mat<float, 4, 4>> mvps;          // per instance slot of the frame
+        std::vector<mat<float, 3, 3>> rotations;
+    } batch;
+    visibility_t visibility; // per-frame triangle ids when deferred
+    bvh_t::result visible; // per-instance face and vertex runs that survived culling
+    clipbuffer_t clip;     // per-draw transformed vertices
+    binner_t binner;
 };
 
 void line(vec<int, 2> a, vec<int, 2> b, framebuffer_t &framebuffer, color_t color) {
@@ -106,76 +182,160 @@ void raster(int ax, int ay, int bx, int by, int cx, int cy, framebuffer_t &frame
 }
 
 
-double inline tArea(vec<int, 2> a, vec<int, 2> b, vec<int, 2> c){
-    return .5*((b[1]-a[1])*(b[0]+a[0]) + (c[1]-b[1])*(c[0]+b[0]) + (a[1]-c[1])*(a[0]+c[0]));
+// bins and rasterizes a draw's faces into target, returns the fragments P shaded
+template<typename P, typename D>
+size_t rasterBatch(state_t& state, framebuffer_t& target, D& depthbuffer, const mesh_t& mesh, const shading_t& shading,
+                   const frustum_t& frustum, stopwatch_t& sw){
+    const auto binned = state.binner.bin<P>(mesh.faces, state.batch.faces, state.clip, frustum, target.w, target.h,
+                                            target.samples, shading);
+    state.stats.rasterized += binned.kept;
+    state.stats.rejected += binned.rejected;
+    state.stats.clipped += binned.clipped;
+    state.stats.bin += sw.lap();
+    const auto skipped = state.binner.raster<P>(target, depthbuffer, shading);
+    state.stats.occluded += skipped.triangles;
+    state.stats.occludedBlocks += skipped.blocks;
+    state.stats.fragments += skipped.fragments;
+    state.stats.tested += skipped.tested;
+    state.stats.raster += sw.lap();
+    return P::fragment::color ? skipped.fragments : 0;
 }
 
-void rasterOMP(vec<int, 3> a, vec<int, 3> b, vec<int, 3> c, framebuffer_t& framebuffer, framebuffer_t& depthbuffer){
-    double area = tArea(vec<int, 2>{a[0], a[1]}, vec<int, 2>{b[0], b[1]}, vec<int, 2>{c[0], c[1]});
-    if(std::abs(area) < 1e-6) return;
-    if(area<1) return; // backface & area culling
-
-    int bbXMin = std::min(std::min(a[0], b[0]), c[0]);
-    int bbXMax = std::max(std::max(a[0], b[0]), c[0]);
-    int bbYMin = std::min(std::min(a[1], b[1]), c[1]);
-    int bbYMax = std::max(std::max(a[1], b[1]), c[1]);
-    bbXMin = std::max(bbXMin, 0);
-    bbXMax = std::min(bbXMax, framebuffer.w - 1);
-    bbYMin = std::max(bbYMin, 0);
-    bbYMax = std::min(bbYMax, framebuffer.h - 1);
-    if(bbXMin >= bbXMax || bbYMin >= bbYMax) return;
-    color_t col = {};
-    col[0] = rand()%255;
-    col[1] = rand()%255;
-    col[2] = rand()%255;
-    col[3] = 255;
-
-// #pragma omp parallel for // this kills perf, consider memory alignment and cache behavior
-    for(int x = bbXMin; x < bbXMax; x++){
-        for(int y = bbYMin; y < bbYMax; y++){
-            double α = tArea(vec<int, 2>{x, y}, vec<int, 2>{b[0], b[1]}, vec<int, 2>{c[0], c[1]}) / area;
-            double β = tArea(vec<int, 2>{x, y}, vec<int, 2>{c[0], c[1]}, vec<int, 2>{a[0], a[1]}) / area;
-            double γ = tArea(vec<int, 2>{x, y}, vec<int, 2>{a[0], a[1]}, vec<int, 2>{b[0], b[1]}) / area;
-            if(α<0|| β<0|| γ<0) continue;
-            unsigned char z = static_cast<unsigned char>(α * a[2] + β * b[2] + γ * c[2]);
-            col[0] = z;
-            col[1] = z;
-            col[2] = z;
-            col[3] = z;
-            if(z <= depthbuffer.get(x, y)[0]) continue;
-            depthbuffer.set(x, y, {z});
-            framebuffer.set(x, y, col);
+// Draws every instance in the scene. Instances get a level of detail each and
+// are grouped by the mesh that gives them, nearest first within a group; a
+// group then goes through culling, the vertex stage, the binner and the
+// rasterizer once, however many instances it holds, the mesh's attributes and
+// bvh shared by all of them. Only positions are transformed per instance.
+// Instances are dropped whole when the hierarchical z already covers their
+// bvh root, which sees what earlier groups drew. With state.batch off every
+// instance is a draw of its own, as separate drawModel calls were.
+//
+// With state.deferred the draws only write triangle ids and the frame is
+// shaded in one pass at the end, see visibility.hpp.
+template<typename P, typename D>
+void drawScene(state_t& state, framebuffer_t& framebuffer, D& depthbuffer, const scene_t& scene){
+    TRACE_ZONE("drawScene");
+    stopwatch_t sw;
+    const frustum_t frustum(framebuffer.w, framebuffer.h, state.camera.nearZ, state.camera.farZ);
+    auto& draws = state.draws;
+    draws.clear();
+    for(uint32_t i = 0; i < scene.instances.size(); i++){
+        const instance_t& instance = scene.instances[i];
+        const model_t& model = scene.models[instance.model];
+        const mat<float, 4, 4> mvp = state.viewproj * instance.world;
+        const uint32_t level = static_cast<uint32_t>(state.lod < 0 ? model.level(mvp, framebuffer.w, framebuffer.h)
+                                                                   : std::min<size_t>(state.lod, model.levels() - 1));
+        const mesh_t& mesh = model.lod(level);
+        const vec<float, 3> center = mesh.bvh.nodes.empty() ? vec<float, 3>{} : (mesh.bvh.nodes[0].min + mesh.bvh.nodes[0].max) * 0.5f;
+        const float distance = mvp[3][0]*center[0] + mvp[3][1]*center[1] + mvp[3][2]*center[2] + mvp[3][3];
+        draws.push_back({i, instance.model, level, distance, mvp});
+        state.stats.submitted += mesh.faces.size();
+        if(level < std::size(state.stats.lods)) state.stats.lods[level]++;
+    }
+    std::sort(draws.begin(), draws.end(), [](const draw_t& a, const draw_t& b){
+        return a.model != b.model ? a.model < b.model : a.level != b.level ? a.level < b.level : a.distance < b.distance;
+    });
+    state.stats.instances = scene.instances.size();
+    state.stats.cull += sw.lap();
+
+    // fixed key light, above the models and in front of them
+    const vec<float, 3> light = {0.30f, -0.65f, 0.70f};
+    auto& batch = state.batch;
+    batch.mvps.clear();
+    batch.rotations.clear();
+    const bool deferred = P::fragment::color && state.deferred && framebuffer.samples == 1;
+    if(deferred){
+        state.visibility.clear(framebuffer.w, framebuffer.h, framebuffer.tiled);
+        state.binner.named.clear();
+    }
+    for(size_t first = 0, end; first < draws.size(); first = end){
+        const model_t& model = scene.models[draws[first].model];
+        const mesh_t& mesh = model.lod(draws[first].level);
+        end = first + 1;
+        if(state.batching)
+            while(end < draws.size() && draws[end].model == draws[first].model && draws[end].level == draws[first].level) end++;
+
+        batch.faces.clear();
+        batch.vertices.clear();
+        const size_t slots = batch.mvps.size();
+        size_t count = 0; // clip buffer entries handed out
+        for(size_t d = first; d < end; d++){
+            if(!mesh.bvh.nodes.empty() && occluded<D>(mesh.bvh.nodes[0], draws[d].mvp, frustum, depthbuffer.hiz)){
+                state.stats.instancesOccluded++;
+                state.stats.culled += mesh.faces.size();
+                continue;
+            }
+            mesh.bvh.cull(frustumPlanes(draws[d].mvp, state.camera.nearZ, state.camera.farZ), state.visible);
+            state.stats.culled += state.visible.culled;
+            if(state.visible.faces.empty()) continue;
+
+            // room for the span of vertices this instance uses
+            const uint32_t slot = static_cast<uint32_t>(batch.mvps.size());
+            uint32_t lo = state.visible.vertices.front()[0], hi = lo;
+            for(const auto& r : state.visible.vertices){ lo = std::min(lo, r[0]); hi = std::max(hi, r[1]); }
+            const int64_t base = static_cast<int64_t>(count) - lo;
+            count += hi - lo + 1;
+            for(const auto& r : state.visible.faces) batch.faces.push_back({r[0], r[1], base, slot});
+            for(const auto& r : state.visible.vertices){
+                batch.vertices.push_back({r[0], r[1] + 1, base, slot});
+                state.stats.vertices += r[1] - r[0] + 1;
+            }
+            const mat<float, 4, 4>& world = scene.instances[draws[d].instance].world;
+            batch.mvps.push_back(draws[d].mvp);
+            batch.rotations.push_back({world[0][0], world[0][1], world[0][2],
+                                       world[1][0], world[1][1], world[1][2],
+                                       world[2][0], world[2][1], world[2][2]});
+            if(deferred) state.visibility.instances.push_back({&mesh, &model.texture});
         }
+        state.stats.cull += sw.lap();
+        if(batch.mvps.size() == slots) continue;
+        state.stats.instancesDrawn += batch.mvps.size() - slots;
+        state.stats.draws++;
+
+        transformVertices(mesh.vertices, batch.vertices, batch.mvps.data(), count, frustum, state.clip);
+        state.stats.transform += sw.lap();
+
+        const shading_t shading = {mesh.uvs.data(), mesh.normals.data(), mesh.colors.data(), &model.texture,
+                                   batch.rotations.data(), light / light.length(), 0.25f};
+        if constexpr (P::fragment::color)
+            if(deferred){
+                rasterBatch<idpass_t<P>>(state, state.visibility.ids, depthbuffer, mesh, shading, frustum, sw);
+                continue;
+            }
+        state.stats.shaded += rasterBatch<P>(state, framebuffer, depthbuffer, mesh, shading, frustum, sw);
     }
-}
-
-inline vec<int, 3> mvpv(vec<float, 3> a, const mat<float, 4, 4>& mvp, int width, int height){
-    vec<float, 4> p = {a[0], a[1], a[2], 1};
-    p  = mvp * p;
-
-    if(p[3] <= 1e-6f) return {-1, -1, -1};
-    float ndcX = p[0] / p[3];
-    float ndcY = p[1] / p[3];
-    float ndcZ = p[2] / p[3];
 
-    int sx = static_cast<int>((ndcX * 0.5f + 0.5f) * (width - 1));
-    int sy = static_cast<int>((1.0f - (ndcY * 0.5f + 0.5f)) * (height - 1)); // flip Y for screen coords
-    int sz = static_cast<int>((ndcZ * 0.5f + 0.5f) * 255.0f); // for your depthbuffer
-
-    return {sx, sy, sz};
+    if constexpr (P::fragment::color)
+        if(deferred){
+            state.stats.shaded += state.visibility.shade<P, D>(framebuffer, state.binner.named, batch.mvps.data(),
+                                                                batch.rotations.data(), light / light.length(), 0.25f, frustum);
+            state.stats.shade += sw.lap();
+        }
 }
 
-void drawModel(state_t& state, framebuffer_t& framebuffer, framebuffer_t& depthbuffer, const model_t& model){
-    for(const auto& f : model.faces){
-        vec<int, 3> a = mvpv(model.vertices[f[0]-1], state.mvp, state.width, state.height);
-        vec<int, 3> b = mvpv(model.vertices[f[1]-1], state.mvp, state.width, state.height);
-        vec<int, 3> c = mvpv(model.vertices[f[2]-1], state.mvp, state.width, state.height);
-        if(a[0] < 0 || b[0] < 0 || c[0] < 0) continue;
-        rasterOMP(a, b, c, framebuffer, depthbuffer);
+// one instantiation of the whole draw per pipeline, picked once per frame
+template<typename D>
+void drawScene(state_t& state, framebuffer_t& framebuffer, D& depthbuffer, const scene_t& scene){
+    switch(state.program){
+        case program_t::depth:    drawScene<depthonly_t>(state, framebuffer, depthbuffer, scene); break;
+        case program_t::flat:     drawScene<flat_t>(state, framebuffer, depthbuffer, scene); break;
+        case program_t::lit:      drawScene<lit_t>(state, framebuffer, depthbuffer, scene); break;
+        case program_t::textured: drawScene<textured_t>(state, framebuffer, depthbuffer, scene); break;
     }
 }
 
+// a frame's counters as trace counter tracks
+void traceCounters([[maybe_unused]] const stats_t& stats){
+    TRACE_COUNTER("triangles submitted", stats.submitted);
+    TRACE_COUNTER("triangles culled", stats.culled + stats.rejected);
+    TRACE_COUNTER("triangles rasterized", stats.rasterized);
+    TRACE_COUNTER("pixels tested", stats.tested);
+    TRACE_COUNTER("pixels written", stats.fragments);
+}
+
+#ifndef HEADLESS
 void getInput(state_t& state){
+    TRACE_ZONE("getInput");
     SDL_Event e;
     while(SDL_PollEvent(&e));
     const uint8_t* keys = SDL_GetKeyboardState(nullptr);
@@ -195,7 +355,10 @@ void getInput(state_t& state){
     state.controls.pitch = std::clamp(state.controls.pitch, -89000, 89000);
 }
 
+#endif
+
 void updateCamera(state_t& state){
+    TRACE_ZONE("updateCamera");
     const float dt = std::max(0.0f, static_cast<float>(state.time.delta.count()) / 1000.0f);
     constexpr float moveSpeed = 3.0f; // world units per second
 
@@ -250,20 +413,7 @@ void updateCamera(state_t& state){
 }
 
 void updateMVP(state_t& state){
-    constexpr mat<float, 4, 4> idn = {
-         1,  0,  0,  0,
-         0,  1,  0,  0,
-         0,  0,  1,  0,
-         0,  0,  0,  1,
-    };
-    constexpr mat<float, 4, 4> rot = {
-         1,  0,  0,  0,
-         0,  0, -1,  0,
-         0,  1,  0,  0,
-         0,  0,  0,  1,
-    };
-    mat<float, 4, 4> model = idn * rot;
-
+    TRACE_ZONE("updateMVP");
     vec<float, 3> f = state.camera.forward / state.camera.forward.length();
     vec<float, 3> s = state.camera.right / state.camera.right.length();
     vec<float, 3> u = state.camera.up / state.camera.up.length();
@@ -277,68 +427,335 @@ void updateMVP(state_t& state){
     mat<float, 4, 4> proj = {};
     constexpr float fovy = 45 * (std::numbers::pi / 180);
     float aspect = (float)state.width / (float)state.height;
-    float nearZ = 0.1f;
-    float farZ = 100.0f;
+    const float nearZ = state.camera.nearZ;
+    const float farZ = state.camera.farZ;
     float g = 1.0f /tan(fovy / 2);
     proj[0][0] = g / aspect;
     proj[1][1] = g;
-    proj[2][2] = (farZ + nearZ) / (nearZ - farZ);
-    proj[2][3] = (2.0f * farZ * nearZ) / (nearZ - farZ);
+    // depth lands in [0,1] directly; reversed-Z swaps near and far so float
+    // precision is spent far from the camera where perspective depth bunches up
+    if(state.reversedZ){
+        proj[2][2] = nearZ / (farZ - nearZ);
+        proj[2][3] = (farZ * nearZ) / (farZ - nearZ);
+    } else {
+        proj[2][2] = farZ / (nearZ - farZ);
+        proj[2][3] = (farZ * nearZ) / (nearZ - farZ);
+    }
     proj[3][2] = -1.0f;
 
-    state.mvp = ((proj * view) * model);
+    state.viewproj = proj * view;
 }
 
+// count instances of a model, upright (the obj is y up, the world z up) on a
+// grid in the ground plane, filled in square rings out from the one at the
+// origin; firstRing 1 leaves the center cell to something else
+void placeInstances(scene_t& scene, uint32_t model, int count, int firstRing = 0){
+    constexpr mat<float, 4, 4> rot = {
+         1,  0,  0,  0,
+         0,  0, -1,  0,
+         0,  1,  0,  0,
+         0,  0,  0,  1,
+    };
+    constexpr float SPACING = 2.5f;
+    for(int i = 0, ring = firstRing; i < count; ring++){
+        // ring r is the square of cells at distance r from the center
+        for(int y = -ring; y <= ring && i < count; y++)
+            for(int x = -ring; x <= ring && i < count; x++){
+                if(std::max(std::abs(x), std::abs(y)) != ring) continue;
+                scene.add(model, translation({x * SPACING, y * SPACING, 0.0f}) * rot);
+                i++;
+            }
+    }
+    scene.update();
+}
+
+#ifndef HEADLESS
+// A frame rendered below the window size goes into the texture's top left
+// corner and that rect is stretched over the whole window.
 void showFramebuffer(state_t& state, const framebuffer_t& fb) {
-    SDL_UpdateTexture(state.sdlTexture, nullptr, fb.data.data(), fb.w * fb.bpp);
+    TRACE_ZONE("showFramebuffer");
+    const SDL_Rect rect = {0, 0, fb.w, fb.h};
+    SDL_UpdateTexture(state.sdlTexture, &rect, fb.image(), fb.imagePitch());
     SDL_RenderClear(state.sdlRenderer);
-    SDL_RenderCopy(state.sdlRenderer, state.sdlTexture, nullptr, nullptr);
+    SDL_RenderCopy(state.sdlRenderer, state.sdlTexture, &rect, nullptr);
     SDL_RenderPresent(state.sdlRenderer);
 
-    state.time.end = std::chrono::high_resolution_clock::now();
-    const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(state.time.end - state.time.start).count();
-    //SDL_Delay(std::max(state.time.frameTime - static_cast<double>(elapsedMs), 0.0));
-
-    // delta is the full frame time (work + optional delay), used by input/movement.
-    state.time.end = std::chrono::high_resolution_clock::now();
-    state.time.delta = std::chrono::duration_cast<std::chrono::milliseconds>(state.time.end - state.time.start);
+    // pace to frameTime, then the whole interval since the last present is the delta movement uses
+    auto now = std::chrono::steady_clock::now();
+    const auto due = state.time.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(state.time.frameTime));
+    if(now < due){
+        TRACE_ZONE("pace");
+        std::this_thread::sleep_until(due);
+        now = std::chrono::steady_clock::now();
+    }
+    state.time.delta = now - state.time.start;
+    state.time.start = now;
 }
 
 void initWindow(state_t& state, framebuffer_t& framebuffer){
     SDL_SetMainReady();
     SDL_Init(SDL_INIT_VIDEO);
     state.sdlWindow    = SDL_CreateWindow("Software Renderer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, state.width, state.height, 0);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear"); // upscales of scaled down frames
     state.sdlRenderer  = SDL_CreateRenderer(state.sdlWindow, -1, SDL_RENDERER_ACCELERATED);
     state.sdlTexture   = SDL_CreateTexture(state.sdlRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, framebuffer.w, framebuffer.h);
     SDL_SetRelativeMouseMode(SDL_TRUE);
 };
 
+#else
+// scripted orbit around the model: one full turn over the run, dipping in close
+// halfway; distance scales the radius
+void updateOrbit(state_t& state, int frame, int frames, float distance){
+    const float t = static_cast<float>(frame) / static_cast<float>(std::max(frames, 1));
+    const float θ = 2.0f * std::numbers::pi_v<float> * t;
+    state.controls.yaw = static_cast<int32_t>(90000.0f + 360000.0f * t);
+    state.controls.pitch = -15000;
+    updateCamera(state);
+    const float radius = (2.25f + 0.75f * std::cos(2.0f * θ)) * distance;
+    state.camera.position = state.camera.forward * -radius;
+}
+
+// binary PPM of the color buffer, for diffing frames between rasterizer changes
+void dumpFramebuffer(const framebuffer_t& fb, const std::string& path){
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << fb.w << ' ' << fb.h << "\n255\n";
+    for(int y = 0; y < fb.h; y++)
+        for(int x = 0; x < fb.w; x++)
+            out.write(reinterpret_cast<const char*>(fb.image() + y * fb.imagePitch() + x * fb.bpp), 3);
+}
+
+template<typename D>
+int runBenchmark(state_t& state, framebuffer_t& framebuffer, const scene_t& scene, const options_t& options){
+    D depthbuffer(state.width, state.height, framebuffer.samples, framebuffer.tiled);
+    depthbuffer.hiz.enabled = options.hiz;
+    state.reversedZ = D::reversed;
+    resolution_t resolution{.budget = std::max(options.budget, 0.0)};
+    benchmark_t bench;
+    const perfcounters_t counters;
+    for(int i = 0; i < options.frames; i++){
+        TRACE_ZONE("frame");
+        state.stats = {};
+        const perfcounters_t::values before = counters.read();
+        stopwatch_t frame, sw;
+        {
+            TRACE_ZONE("clear");
+            framebuffer.resize(resolution_t::size(state.width, resolution.scale),
+                               resolution_t::size(state.height, resolution.scale));
+            depthbuffer.resize(framebuffer.w, framebuffer.h);
+            depthbuffer.clear();
+            framebuffer.clear();
+        }
+        state.stats.clear = sw.lap();
+        updateOrbit(state, i, options.frames, options.orbit);
+        updateMVP(state);
+        state.stats.mvp = sw.lap();
+        drawScene(state, framebuffer, depthbuffer, scene);
+        sw.lap();
+        {
+            TRACE_ZONE("resolve");
+            framebuffer.resolve();
+        }
+        state.stats.resolve = sw.lap();
+        state.stats.frame = frame.ms();
+        const perfcounters_t::values after = counters.read();
+        state.stats.l1dMisses = after[perfcounters_t::l1d] - before[perfcounters_t::l1d];
+        state.stats.llcMisses = after[perfcounters_t::llc] - before[perfcounters_t::llc];
+        state.stats.dtlbMisses = after[perfcounters_t::dtlb] - before[perfcounters_t::dtlb];
+        state.stats.scale = resolution.scale;
+        state.stats.missed = resolution.missed(state.stats.frame);
+        resolution.update(state.stats.frame, state.stats.scale);
+        traceCounters(state.stats);
+        bench.record(state.stats);
+    }
+    if(!options.dump.empty()) dumpFramebuffer(framebuffer, options.dump);
+    bench.report(std::cout, {PATH, spanKernel.name, options.depth, options.shade, state.width, state.height,
+                             omp_get_max_threads(), options.hiz, options.msaa,
+                             state.deferred && framebuffer.samples == 1 && state.program != program_t::depth,
+                             framebuffer.tiled, counters.available, options.load, resolution.budget,
+                             scene.models[options.model].sourceAcmr, scene.models[options.model].acmr});
+    return 0;
+}
+
+// one report line per thread count: 1, 2, 4, ... up to the machine's maximum
+template<typename D>
+int runSweep(state_t& state, framebuffer_t& framebuffer, const scene_t& scene, const options_t& options){
+    const int max = omp_get_max_threads();
+    for(int t = 1; ; t = std::min(t * 2, max)){
+        omp_set_num_threads(t);
+        runBenchmark<D>(state, framebuffer, scene, options);
+        if(t == max) break;
+    }
+    omp_set_num_threads(max);
+    return 0;
+}
+
+template<typename D>
+int runHeadless(state_t& state, framebuffer_t& framebuffer, const scene_t& scene, const options_t& options){
+    if(options.sweep) return runSweep<D>(state, framebuffer, scene, options);
+    return runBenchmark<D>(state, framebuffer, scene, options);
+}
+#endif
+
 int main(int argc, char** argv) {
     state_t state;
-    model_t model(PATH);
-    framebuffer_t framebuffer(state.width, state.height);
-    framebuffer_t depthbuffer(state.width, state.height);
-
+    options_t options;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--frames" && i + 1 < argc) options.frames = std::atoi(argv[++i]);
+        else if(arg == "--size" && i + 1 < argc)
+            std::sscanf(argv[++i], "%hux%hu", &state.width, &state.height);
+        else if(arg == "--dump" && i + 1 < argc) options.dump = argv[++i];
+        else if(arg == "--isa" && i + 1 < argc) spanKernel = selectSpanKernel(argv[++i]);
+        else if(arg == "--threads" && i + 1 < argc) omp_set_num_threads(std::atoi(argv[++i]));
+        else if(arg == "--sweep") options.sweep = true;
+        else if(arg == "--depth" && i + 1 < argc) options.depth = argv[++i];
+        else if(arg == "--no-cache") options.cache = false;
+        else if(arg == "--no-hiz") options.hiz = false;
+        else if(arg == "--math") options.math = true;
+        else if(arg == "--msaa" && i + 1 < argc) options.msaa = std::atoi(argv[++i]) > 1 ? SAMPLES : 1;
+        else if(arg == "--shade" && i + 1 < argc) options.shade = argv[++i];
+        else if(arg == "--latency" && i + 1 < argc) options.latency = std::clamp(std::atoi(argv[++i]), 1, 3);
+        else if(arg == "--fps" && i + 1 < argc) options.fps = std::atof(argv[++i]);
+        else if(arg == "--orbit" && i + 1 < argc) options.orbit = std::max(0.1f, static_cast<float>(std::atof(argv[++i])));
+        else if(arg == "--lod" && i + 1 < argc) state.lod = std::atoi(argv[++i]);
+        else if(arg == "--budget" && i + 1 < argc) options.budget = std::atof(argv[++i]);
+        else if(arg == "--instances" && i + 1 < argc) options.instances = std::max(1, std::atoi(argv[++i]));
+        else if(arg == "--no-batch") state.batching = false;
+        else if(arg == "--occluder") options.occluder = true;
+        else if(arg == "--visibility") state.deferred = true;
+        else if(arg == "--tiled") options.tiled = true;
+#ifdef TRACE
+        else if(arg == "--trace" && i + 1 < argc) tracing().path = argv[++i];
+#else
+        else if(arg == "--trace" && i + 1 < argc){
+            i++;
+            std::cerr << "--trace: not a tracing build, see TRACE=1 in the readme" << std::endl;
+        }
+#endif
+    }
+    TRACE_THREAD("main");
+#ifdef HEADLESS
+    if(options.math){
+        mathbench_t().report(std::cout);
+        return 0;
+    }
+#endif
+    stopwatch_t load;
+    scene_t scene;
+    if(options.occluder){
+        // loaded first so its group draws first and the hiz already holds it
+        // when the instances behind it are tested
+        scene.add(scene.load(model_t::box({1.2f, 1.2f, 2.0f})), scene_t::identity);
+    }
+    options.model = scene.load(PATH, options.cache);
+    placeInstances(scene, options.model, options.instances, options.occluder ? 1 : 0);
+    options.load = load.ms();
+    framebuffer_t framebuffer(state.width, state.height, options.msaa, options.tiled);
+    if(options.shade == "depth") state.program = program_t::depth;
+    else if(options.shade == "flat") state.program = program_t::flat;
+    else if(options.shade == "lit") state.program = program_t::lit;
+    else options.shade = "textured";
+
+#ifdef HEADLESS
+    if(options.depth == "u16") return runHeadless<depth16_t>(state, framebuffer, scene, options);
+    if(options.depth == "u24") return runHeadless<depth24_t>(state, framebuffer, scene, options);
+    if(options.depth == "f32") return runHeadless<depthf_t>(state, framebuffer, scene, options);
+    options.depth = "rf32";
+    return runHeadless<depthrf_t>(state, framebuffer, scene, options);
+#else
+    depthrf_t depthbuffer(state.width, state.height, options.msaa, options.tiled);
+    depthbuffer.hiz.enabled = options.hiz;
+    state.reversedZ = depthrf_t::reversed;
     int t = omp_get_max_threads();
     std::cout << "system has " << t << " threads" << std::endl;
 
     initWindow(state, framebuffer);
+    state.time.frameTime = options.fps > 0.0 ? 1000.0 / options.fps : 0.0;
+    resolution_t resolution{.budget = options.budget >= 0.0 ? options.budget : state.time.frameTime};
+
+    // Frame pipeline: the main thread polls input, moves the camera and presents,
+    // a render thread draws. Up to `latency` frames are in flight, so frame N+1
+    // rasterizes while frame N is uploaded and presented.
+    std::deque<frameslot_t> slots;
+    std::deque<frameslot_t*> idle;
+    for(int i = 0; i < options.latency; i++) idle.push_back(&slots.emplace_back(state.width, state.height, options.msaa, options.tiled));
+    boundedqueue<frameslot_t*> todo(options.latency), ready(options.latency);
+
+    state_t render = state; // the render thread's own binner, clip buffer and stats
+    std::thread renderer([&]{
+        omp_set_num_threads(t); // a new thread starts from the default, not what --threads set
+        TRACE_THREAD("render");
+        frameslot_t* slot;
+        while(todo.pop(slot)){
+            TRACE_ZONE("render frame");
+            stopwatch_t frame, sw;
+            render.viewproj = slot->viewproj;
+            render.stats = {};
+            {
+                TRACE_ZONE("clear");
+                slot->framebuffer.resize(resolution_t::size(render.width, slot->scale),
+                                         resolution_t::size(render.height, slot->scale));
+                depthbuffer.resize(slot->framebuffer.w, slot->framebuffer.h);
+                depthbuffer.clear();
+                slot->framebuffer.clear();
+            }
+            render.stats.clear = sw.lap();
+            drawScene(render, slot->framebuffer, depthbuffer, scene);
+            sw.lap();
+            {
+                TRACE_ZONE("resolve");
+                slot->framebuffer.resolve();
+            }
+            render.stats.resolve = sw.lap();
+            render.stats.frame = frame.ms();
+            render.stats.scale = slot->scale;
+            traceCounters(render.stats);
+            slot->stats = render.stats;
+            ready.push(slot);
+        }
+        ready.close();
+    });
+
+    state.time.start = std::chrono::steady_clock::now();
+    size_t inflight = 0, misses = 0;
     while(state.controls.running){
-        std::cout << '\r' << "ft: " << state.time.delta.count() << " mS" << std::flush;
-        state.time.start = std::chrono::high_resolution_clock::now();
-        depthbuffer.clear();
-        framebuffer.clear();
+        TRACE_ZONE("frame");
         getInput(state);
         updateCamera(state);
         updateMVP(state);
-        drawModel(state, framebuffer, depthbuffer, model);
-        showFramebuffer(state, framebuffer);
+        frameslot_t* slot = idle.front();
+        idle.pop_front();
+        slot->viewproj = state.viewproj;
+        slot->scale = resolution.scale;
+        todo.push(slot);
+        if(++inflight < slots.size()) continue;
+
+        // pipeline full: present the oldest frame while the newest renders
+        {
+            TRACE_ZONE("wait");
+            ready.pop(slot);
+        }
+        inflight--;
+        // the scale feeds back a frame or two late, which the smoothing absorbs
+        slot->stats.missed = resolution.missed(slot->stats.frame);
+        misses += slot->stats.missed;
+        resolution.update(slot->stats.frame, slot->scale);
+        showFramebuffer(state, slot->framebuffer);
+        std::cout << '\r' << "ft: " << state.time.delta.count() << " mS, render: " << slot->stats.frame
+                  << " mS, scale: " << slot->scale << ", budget misses: " << misses << "   " << std::flush;
+        idle.push_back(slot);
     } std::cout << std::endl << std::flush;
 
+    todo.close();
+    for(frameslot_t* slot; ready.pop(slot);) {}
+    renderer.join();
+
     SDL_DestroyTexture(state.sdlTexture);
     SDL_DestroyRenderer(state.sdlRenderer);
     SDL_DestroyWindow(state.sdlWindow);
     SDL_Quit();
 
     return 0;
+#endif
 }
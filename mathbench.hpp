@@ -0,0 +1,73 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <random>
+#include <vector>
+
+#include "bench.hpp"
+#include "framebuffer.hpp"
+#include "geometry.hpp"
+
+// Micro-benchmark of the 4x4 kernels in geometry.hpp, the generic loops against
+// the SSE ones. Arrays are sized to stay in cache so the arithmetic is
+// what gets measured; each case reports the best round in ns per call and
+// whether every result matched the generic one to the bit.
+using mathbench_t =
+struct mathbench {
+    static constexpr size_t COUNT = 4096;
+
+    explicit mathbench(int rounds = 200) : rounds(rounds) {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> u(-2.0f, 2.0f);
+        for(auto& r : m.data) for(size_t k = 0; k < 4; k++) r[k] = u(rng);
+        vectors.resize(COUNT);
+        matrices.resize(COUNT);
+        for(auto& v : vectors) v = {u(rng), u(rng), u(rng), u(rng)};
+        for(auto& a : matrices) for(auto& r : a.data) for(size_t k = 0; k < 4; k++) r[k] = u(rng);
+    }
+
+    void report(std::ostream& out){
+        std::vector<vec<float, 4>, aligned<vec<float, 4>>> expect(COUNT), got(COUNT);
+        std::vector<mat<float, 4, 4>, aligned<mat<float, 4, 4>>> expectM(COUNT), gotM(COUNT);
+
+        out << '{';
+        out << "\"mat_vec\":{";
+        entry(out, "generic", expect, [&]{ for(size_t i = 0; i < COUNT; i++) expect[i] = m.mulScalar(vectors[i]); });
+#ifdef GEOMETRY_X86
+        out << ',';
+        entry(out, "sse", got, [&]{ for(size_t i = 0; i < COUNT; i++) got[i] = m.mulSSE(vectors[i]); }, &expect);
+#endif
+        out << "},\"mat_mat\":{";
+        entry(out, "generic", expectM, [&]{ for(size_t i = 0; i < COUNT; i++) expectM[i] = matrices[i].mulScalar(m); });
+#ifdef GEOMETRY_X86
+        out << ',';
+        entry(out, "sse", gotM, [&]{ for(size_t i = 0; i < COUNT; i++) gotM[i] = matrices[i].mulSSE(m); }, &expectM);
+#endif
+        out << "}}" << std::endl;
+    }
+
+private:
+    // best round, ns per element; the asm barrier keeps the stores from being dropped
+    template<typename V, typename F>
+    void entry(std::ostream& out, const char* name, V& result, F run, const V* expect = nullptr){
+        double best = std::numeric_limits<double>::infinity();
+        for(int r = 0; r < rounds; r++){
+            stopwatch_t sw;
+            run();
+            asm volatile("" : : "r"(result.data()) : "memory");
+            best = std::min(best, sw.ms());
+        }
+        out << '"' << name << "_ns\":" << best * 1e6 / COUNT;
+        if(expect)
+            out << ",\"" << name << "_match\":"
+                << (std::memcmp(result.data(), expect->data(), COUNT * sizeof(result[0])) ? "false" : "true");
+    }
+
+    int rounds;
+    mat<float, 4, 4> m;
+    std::vector<vec<float, 4>, aligned<vec<float, 4>>> vectors;
+    std::vector<mat<float, 4, 4>, aligned<mat<float, 4, 4>>> matrices;
+};
@@ -1,41 +1,502 @@
 #pragma once
-#include <iostream>
-#include <string>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.hpp"
 #include "geometry.hpp"
+#include "simplify.hpp"
+#include "texture.hpp"
+#include "vertexcache.hpp"
 
 using vertex_t = vec<float,  3>;
-using face_t   = vec<size_t, 3>;
+using uv_t     = vec<float,  2>;
+using normal_t = vec<float,  3>;
+using rgb_t    = vec<float,  3>; // vertex color, white when the obj has none
+using face_t   = vec<uint32_t, 3>; // 1-based indices into the vertex arrays
 
-using model_t =
-struct model {
-    model(std::string path){
-        std::ifstream file(path);
-        if(!file) std::cout << "Model Not Found" << std::endl;
-        std::string line;
-        while(std::getline(file, line)){
-            std::istringstream iss(line);
-            std::string tag;
-            iss >> tag;
-
-            if(tag == "v"){
-                float x, y, z;
-                iss >> x >> y >> z;
-                vertices.emplace_back((vertex_t){x, y, z});
-            } else 
-
-            if (tag == "f"){
-                size_t a, b, c;
-                iss >> a;
-                iss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); iss >> b;
-                iss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); iss >> c;
-                faces.emplace_back((face_t){a, b, c});
+// read-only mapping of a whole file, empty when the file can't be opened
+using mapping_t =
+struct mapping {
+    mapping(const std::string& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0){
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED){
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+                madvise(p, size, MADV_SEQUENTIAL);
             }
         }
+        close(fd);
+    }
+    ~mapping(){ if(data) munmap(const_cast<char*>(data), size); }
+    mapping(const mapping&) = delete;
+    mapping& operator=(const mapping&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+inline const char* objSkip(const char* p, const char* end){
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+inline const char* objNextLine(const char* p, const char* end){
+    const void* nl = memchr(p, '\n', end - p);
+    return nl ? static_cast<const char*>(nl) + 1 : end;
+}
+
+// a tag ("v", "vt", "f", ...) followed by whitespace, so "v" doesn't match "vt"
+inline bool objTag(const char* p, const char* end, std::string_view tag){
+    const size_t n = tag.size();
+    return static_cast<size_t>(end - p) > n && std::equal(tag.begin(), tag.end(), p) && (p[n] == ' ' || p[n] == '\t');
+}
+
+// up to n numbers following a tag into out; returns how many parsed
+inline int objFloats(const char* q, const char* stop, float* out, int n){
+    int k = 0;
+    for(; k < n; k++){
+        q = objSkip(q, stop);
+        auto [next, err] = std::from_chars(q, stop, out[k]);
+        if(err != std::errc{}) break;
+        q = next;
+    }
+    return k;
+}
+
+// One level of detail: its own vertex arrays, faces and the bvh culling walks.
+using mesh_t =
+struct mesh {
+    // sorts the faces into the bvh and carries every per-vertex array along
+    void build(){
+        const std::vector<uint32_t> origin = bvh.build(vertices, faces);
+        permute(uvs, origin);
+        permute(normals, origin);
+        permute(colors, origin);
+        acmr = ::acmr(faces, vertices.size());
+    }
+
+    // the faces' vertices only, in first use order, from a mesh they index
+    static mesh compact(const mesh& from, const std::vector<face_t>& faces, float error){
+        mesh out;
+        out.faces = faces;
+        out.error = error;
+        std::vector<uint32_t> remap(from.vertices.size() + 1, 0);
+        for(face_t& f : out.faces)
+            for(size_t k = 0; k < 3; k++){
+                uint32_t& r = remap[f[k]];
+                if(!r){
+                    out.vertices.push_back(from.vertices[f[k]-1]);
+                    out.uvs.push_back(from.uvs[f[k]-1]);
+                    out.normals.push_back(from.normals[f[k]-1]);
+                    out.colors.push_back(from.colors[f[k]-1]);
+                    r = static_cast<uint32_t>(out.vertices.size());
+                }
+                f[k] = r;
+            }
+        return out;
+    }
+
+    template<typename T>
+    static void permute(std::vector<T>& values, const std::vector<uint32_t>& origin){
+        std::vector<T> out(values.size());
+        for(size_t i = 0; i < origin.size(); i++) out[i] = values[origin[i]];
+        values.swap(out);
     }
+
     std::vector<vertex_t> vertices;
+    std::vector<uv_t> uvs;         // per vertex, like normals and colors
+    std::vector<normal_t> normals; // unit length
+    std::vector<rgb_t> colors;
     std::vector<face_t> faces;
+    bvh_t bvh;        // built after loading, reorders faces and vertices
+    float error = 0;  // farthest simplification moved the surface, model units
+    double acmr = 0;  // vertex cache misses per face in the built order
+};
+
+// The mesh as loaded is level 0; coarser levels are simplified from it once,
+// each with at most a quarter of the faces of the one before, and kept in the
+// cache with it, every level already built.
+using model_t =
+struct model : mesh_t {
+    static constexpr size_t LOD_FACES = 256; // no level gets simplified below this
+    static constexpr float LOD_PIXELS = 1.0f; // error a level may show on screen
+
+    // binary cache written next to the obj: header then the raw vertex, uv,
+    // normal, color, face and bvh node arrays, then per level of detail a
+    // lodheader and the same arrays again. Meshes are stored as build() left
+    // them, so a hit only copies the arrays out of the mapping.
+    struct cacheheader {
+        char magic[8] = {'S', 'R', 'M', 'E', 'S', 'H', '5', '\0'};
+        uint64_t sourceSize = 0;
+        int64_t sourceTime = 0;
+        uint32_t vertexSize = sizeof(vertex_t) + sizeof(uv_t) + sizeof(normal_t) + sizeof(rgb_t);
+        uint32_t faceSize = sizeof(face_t);
+        uint64_t vertexCount = 0;
+        uint64_t faceCount = 0;
+        uint64_t nodeCount = 0;
+        uint64_t lodCount = 0;
+        double sourceAcmr = 0;
+        double acmr = 0;
+    };
+    struct lodheader {
+        uint64_t vertexCount = 0;
+        uint64_t faceCount = 0;
+        uint64_t nodeCount = 0;
+        double error = 0;
+        double acmr = 0;
+    };
+
+    // an obj corner: position, uv and normal index, 1-based, 0 when absent
+    using corner_t = vec<size_t, 3>;
+
+    model(std::string path, bool cache = true){
+        std::error_code ec;
+        cacheheader header;
+        header.sourceSize = std::filesystem::file_size(path, ec);
+        if(ec){ std::cout << "Model Not Found" << std::endl; return; }
+        header.sourceTime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+
+        const std::string cachePath = path + ".cache";
+        if(!cache || !loadCache(cachePath, header)){
+            parse(path);
+            sourceAcmr = ::acmr(faces, vertices.size());
+            simplify();
+            build();
+            for(mesh_t& lod : lods) lod.build();
+            if(cache) writeCache(cachePath, header);
+        }
+
+        // <name>.ppm next to the obj when there is one
+        if(!texture_t::load(std::filesystem::path(path).replace_extension(".ppm"), texture))
+            texture = texture_t::checker();
+    }
+
+    // An axis-aligned box of the given half extents around the origin, white,
+    // flat normals and a checker on every side: big triangles that cover whole
+    // hiz blocks, which makes it the occluder of test scenes. One level, built.
+    static model box(const vec<float, 3>& half){
+        model m;
+        for(size_t axis = 0; axis < 3; axis++)
+            for(float side : {-1.0f, 1.0f}){
+                const size_t u = (axis + 1) % 3, v = (axis + 2) % 3;
+                const uint32_t base = static_cast<uint32_t>(m.vertices.size()) + 1;
+                for(int k = 0; k < 4; k++){
+                    const float su = k == 1 || k == 2 ? 1.0f : -1.0f, sv = k >= 2 ? 1.0f : -1.0f;
+                    vertex_t p = {};
+                    p[axis] = side * half[axis];
+                    p[u] = su * half[u];
+                    p[v] = sv * half[v];
+                    normal_t n = {};
+                    n[axis] = side;
+                    m.vertices.push_back(p);
+                    m.normals.push_back(n);
+                    m.uvs.push_back({su * 0.5f + 0.5f, sv * 0.5f + 0.5f});
+                    m.colors.push_back({1.0f, 1.0f, 1.0f});
+                }
+                // counter-clockwise seen from outside, u x v being the axis
+                if(side > 0.0f) m.faces.insert(m.faces.end(), {{base, base + 1, base + 2}, {base, base + 2, base + 3}});
+                else            m.faces.insert(m.faces.end(), {{base, base + 2, base + 1}, {base, base + 3, base + 2}});
+            }
+        m.sourceAcmr = ::acmr(m.faces, m.vertices.size());
+        m.build();
+        m.texture = texture_t::checker();
+        return m;
+    }
+private:
+    model() = default;
+public:
+
+    // Level of detail for drawing with mvp into a w x h viewport: the coarsest
+    // whose error stays under LOD_PIXELS where the model's bounding sphere comes
+    // nearest the camera. The rows of mvp's 3x3 part scale model units to clip
+    // units, so their lengths over w give pixels per unit at that distance.
+    size_t level(const mat<float, 4, 4>& mvp, int w, int h) const {
+        if(lods.empty() || bvh.nodes.empty()) return 0;
+        const vec<float, 3> center = (bvh.nodes[0].min + bvh.nodes[0].max) * 0.5f;
+        const float radius = (bvh.nodes[0].max - center).length();
+        auto axis = [&](size_t r){ return vec<float, 3>{mvp[r][0], mvp[r][1], mvp[r][2]}.length(); };
+        const float distance = mvp[3][0]*center[0] + mvp[3][1]*center[1] + mvp[3][2]*center[2] + mvp[3][3]
+                             - radius * axis(3);
+        if(distance <= 0.0f) return 0;
+        const float pixels = std::max(axis(0) * w, axis(1) * h) * 0.5f / distance; // per model unit
+        size_t level = 0;
+        while(level < lods.size() && lods[level].error * pixels <= LOD_PIXELS) level++;
+        return level;
+    }
+
+    // level 0 is the model itself, past the coarsest gives the coarsest
+    const mesh_t& lod(size_t level) const {
+        if(!level || lods.empty()) return *this;
+        return lods[std::min(level, lods.size()) - 1];
+    }
+    size_t levels() const { return lods.size() + 1; }
+
+    bool loadCache(const std::string& path, cacheheader header){
+        mapping_t file(path);
+        if(file.size < sizeof(cacheheader)) return false;
+        cacheheader stored;
+        memcpy(&stored, file.data, sizeof(cacheheader));
+        if(memcmp(stored.magic, header.magic, sizeof(header.magic)) ||
+           stored.sourceSize != header.sourceSize || stored.sourceTime != header.sourceTime ||
+           stored.vertexSize != header.vertexSize || stored.faceSize != header.faceSize)
+            return false;
+        const char* p = file.data + sizeof(cacheheader);
+        const char* end = file.data + file.size;
+        auto read = [&](mesh_t& m, size_t vertexCount, size_t faceCount, size_t nodeCount, double acmr){
+            if(static_cast<size_t>(end - p) < vertexCount * header.vertexSize + faceCount * sizeof(face_t) +
+                                              nodeCount * sizeof(bvhnode_t)) return false;
+            auto array = [&](auto& out, size_t count){
+                out.resize(count);
+                memcpy(out.data(), p, count * sizeof(out[0]));
+                p += count * sizeof(out[0]);
+            };
+            array(m.vertices, vertexCount);
+            array(m.uvs, vertexCount);
+            array(m.normals, vertexCount);
+            array(m.colors, vertexCount);
+            array(m.faces, faceCount);
+            array(m.bvh.nodes, nodeCount);
+            m.acmr = acmr;
+            return true;
+        };
+        if(!read(*this, stored.vertexCount, stored.faceCount, stored.nodeCount, stored.acmr)) return false;
+        sourceAcmr = stored.sourceAcmr;
+        lods.resize(stored.lodCount);
+        for(mesh_t& lod : lods){
+            lodheader l;
+            if(static_cast<size_t>(end - p) < sizeof(lodheader)) return false;
+            memcpy(&l, p, sizeof(lodheader));
+            p += sizeof(lodheader);
+            if(!read(lod, l.vertexCount, l.faceCount, l.nodeCount, l.acmr)) return false;
+            lod.error = static_cast<float>(l.error);
+        }
+        return p == end;
+    }
+
+    void writeCache(const std::string& path, cacheheader header) const {
+        header.vertexCount = vertices.size();
+        header.faceCount = faces.size();
+        header.nodeCount = bvh.nodes.size();
+        header.lodCount = lods.size();
+        header.sourceAcmr = sourceAcmr;
+        header.acmr = acmr;
+        std::ofstream out(path, std::ios::binary);
+        if(!out) return; // read-only asset dirs just go without a cache
+        auto array = [&](const auto& v){ out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(v[0])); };
+        auto write = [&](const mesh_t& m){
+            array(m.vertices);
+            array(m.uvs);
+            array(m.normals);
+            array(m.colors);
+            array(m.faces);
+            array(m.bvh.nodes);
+        };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write(*this);
+        for(const mesh_t& lod : lods){
+            const lodheader l = {lod.vertices.size(), lod.faces.size(), lod.bvh.nodes.size(), lod.error, lod.acmr};
+            out.write(reinterpret_cast<const char*>(&l), sizeof(l));
+            write(lod);
+        }
+    }
+
+    // one simplifier run takes the levels one after the other; a level that
+    // can't halve the faces of the one before (the rest is locked on seams and
+    // borders) isn't worth its memory and ends the chain
+    void simplify(){
+        lods.clear();
+        simplifier_t simplifier(vertices, faces);
+        for(size_t count = faces.size(); count / 4 >= LOD_FACES; ){
+            const std::vector<face_t> reduced = simplifier.reduce(count / 4);
+            if(reduced.size() > count / 2) break;
+            lods.push_back(mesh_t::compact(*this, reduced, simplifier.error()));
+            count = reduced.size();
+        }
+    }
+
+    // Two passes over newline-aligned chunks of the mapped file. The first counts
+    // positions, uvs, normals and triangles per chunk so every array is sized
+    // exactly and every chunk knows where its output starts; the second parses
+    // straight into place. Per-chunk offsets also resolve negative (relative)
+    // indices. Corners then get welded: each distinct position/uv/normal triple
+    // becomes one vertex, so faces keep a single index and the vertex stage and
+    // binner stay indexed per vertex.
+    void parse(const std::string& path){
+        mapping_t file(path);
+        if(!file.data){ std::cout << "Model Not Found" << std::endl; return; }
+        const char* begin = file.data;
+        const char* end = file.data + file.size;
+
+        const int chunks = std::max(1, std::min<int>(omp_get_max_threads() * 4, static_cast<int>(file.size >> 16)));
+        std::vector<const char*> bounds(chunks + 1, end);
+        bounds[0] = begin;
+        for(int i = 1; i < chunks; i++)
+            bounds[i] = std::max(bounds[i-1], objNextLine(begin + file.size * i / chunks, end));
+
+        std::vector<size_t> vertexBase(chunks + 1, 0), uvBase(chunks + 1, 0), normalBase(chunks + 1, 0), faceBase(chunks + 1, 0);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int i = 0; i < chunks; i++){
+            size_t v = 0, vt = 0, vn = 0, f = 0;
+            for(const char* p = bounds[i]; p < bounds[i+1]; p = objNextLine(p, bounds[i+1])){
+                const char* q = objSkip(p, bounds[i+1]);
+                if(objTag(q, bounds[i+1], "v")) v++;
+                else if(objTag(q, bounds[i+1], "vt")) vt++;
+                else if(objTag(q, bounds[i+1], "vn")) vn++;
+                else if(objTag(q, bounds[i+1], "f")){
+                    int corners = 0;
+                    for(q = objSkip(q + 1, bounds[i+1]); q < bounds[i+1] && *q != '\n'; q = objSkip(q, bounds[i+1])){
+                        corners++;
+                        while(q < bounds[i+1] && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n') q++;
+                    }
+                    f += std::max(corners - 2, 0);
+                }
+            }
+            vertexBase[i+1] = v;
+            uvBase[i+1] = vt;
+            normalBase[i+1] = vn;
+            faceBase[i+1] = f;
+        }
+        for(int i = 0; i < chunks; i++){
+            vertexBase[i+1] += vertexBase[i];
+            uvBase[i+1] += uvBase[i];
+            normalBase[i+1] += normalBase[i];
+            faceBase[i+1] += faceBase[i];
+        }
+        std::vector<vertex_t> positions(vertexBase[chunks]);
+        std::vector<rgb_t> tints(vertexBase[chunks], {1.0f, 1.0f, 1.0f});
+        std::vector<uv_t> texcoords(uvBase[chunks]);
+        std::vector<normal_t> directions(normalBase[chunks]);
+        std::vector<std::array<corner_t, 3>> polys(faceBase[chunks]);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int i = 0; i < chunks; i++){
+            size_t v = vertexBase[i], vt = uvBase[i], vn = normalBase[i], f = faceBase[i];
+            const char* stop = bounds[i+1];
+            for(const char* p = bounds[i]; p < stop; p = objNextLine(p, stop)){
+                const char* q = objSkip(p, stop);
+                if(objTag(q, stop, "v")){
+                    // x y z, optionally followed by an r g b vertex color
+                    float in[6] = {};
+                    if(objFloats(q + 1, stop, in, 6) == 6) tints[v] = {in[3], in[4], in[5]};
+                    positions[v++] = {in[0], in[1], in[2]};
+                } else if(objTag(q, stop, "vt")){
+                    float in[2] = {};
+                    objFloats(q + 2, stop, in, 2);
+                    texcoords[vt++] = {in[0], in[1]};
+                } else if(objTag(q, stop, "vn")){
+                    float in[3] = {};
+                    objFloats(q + 2, stop, in, 3);
+                    directions[vn++] = {in[0], in[1], in[2]};
+                } else if(objTag(q, stop, "f")){
+                    // v, v/vt, v//vn or v/vt/vn corners, polygons become a fan around the first
+                    const size_t count[3] = {v, vt, vn};
+                    corner_t corner[3] = {};
+                    int n = 0;
+                    for(q = objSkip(q + 1, stop); q < stop && *q != '\n'; q = objSkip(q, stop)){
+                        corner_t c = {};
+                        bool ok = true;
+                        for(size_t k = 0; k < 3; k++){
+                            if(k){
+                                if(q >= stop || *q != '/') break;
+                                q++;
+                            }
+                            long idx = 0;
+                            auto [next, err] = std::from_chars(q, stop, idx);
+                            if(err != std::errc{}){ ok = ok && k > 0; continue; } // "v//vn" leaves vt empty
+                            q = next;
+                            c[k] = idx < 0 ? static_cast<size_t>(static_cast<long>(count[k]) + idx + 1) : static_cast<size_t>(idx);
+                        }
+                        while(q < stop && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n') q++;
+                        if(!ok) continue;
+                        if(n < 2) corner[n++] = c;
+                        else {
+                            corner[2] = c;
+                            polys[f++] = {corner[0], corner[1], corner[2]};
+                            corner[1] = corner[2];
+                        }
+                    }
+                }
+            }
+        }
+
+        // corners that failed to parse or point outside the vertex list leave
+        // zeroed or dangling faces behind, drop them rather than index past the end;
+        // uv and normal indices out of range just count as absent
+        std::erase_if(polys, [&](const std::array<corner_t, 3>& f){
+            for(const corner_t& c : f)
+                if(c[0] == 0 || c[0] > positions.size()) return true;
+            return false;
+        });
+        for(auto& f : polys)
+            for(corner_t& c : f){
+                if(c[1] > texcoords.size()) c[1] = 0;
+                if(c[2] > directions.size()) c[2] = 0;
+            }
+
+        // weld: a chain per position of the uv/normal pairs it appears with
+        std::vector<uint32_t> head(positions.size() + 1, 0), next;
+        std::vector<corner_t> welded;
+        faces.resize(polys.size());
+        for(size_t f = 0; f < polys.size(); f++)
+            for(size_t k = 0; k < 3; k++){
+                const corner_t& c = polys[f][k];
+                uint32_t i = head[c[0]];
+                while(i && (welded[i-1][1] != c[1] || welded[i-1][2] != c[2])) i = next[i-1];
+                if(!i){
+                    welded.push_back(c);
+                    next.push_back(head[c[0]]);
+                    i = head[c[0]] = static_cast<uint32_t>(welded.size());
+                }
+                faces[f][k] = i;
+            }
+
+        // corners without a normal get the area-weighted average of the faces
+        // around their position
+        std::vector<normal_t> smooth;
+        if(std::any_of(welded.begin(), welded.end(), [](const corner_t& c){ return c[2] == 0; })){
+            smooth.assign(positions.size(), {});
+            for(const auto& f : polys){
+                const vertex_t& a = positions[f[0][0]-1];
+                const normal_t n = (positions[f[1][0]-1] - a).cross(positions[f[2][0]-1] - a);
+                for(const corner_t& c : f) smooth[c[0]-1] = smooth[c[0]-1] + n;
+            }
+        }
+
+        vertices.resize(welded.size());
+        uvs.resize(welded.size());
+        normals.resize(welded.size());
+        colors.resize(welded.size());
+        for(size_t i = 0; i < welded.size(); i++){
+            const corner_t& c = welded[i];
+            vertices[i] = positions[c[0]-1];
+            colors[i] = tints[c[0]-1];
+            uvs[i] = c[1] ? texcoords[c[1]-1] : uv_t{};
+            const normal_t n = c[2] ? directions[c[2]-1] : smooth[c[0]-1];
+            const float len = n.length();
+            normals[i] = len > 0.0f ? n / len : normal_t{};
+        }
+    }
+
+    std::vector<mesh_t> lods; // levels 1, 2, ..., ever coarser
+    double sourceAcmr = 0;    // vertex cache misses per face in the obj's own order
+    texture_t texture;
 };
@@ -0,0 +1,72 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <omp.h>
+#include <vector>
+
+#if defined(__linux__)
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware cache counters for the benchmark: L1 data read misses, last level
+// cache misses and data TLB read misses, summed over the OpenMP threads, which
+// do all of a headless frame's work. Opened per thread through perf_event_open
+// on Linux, user space only. Where there are none (other systems, most virtual
+// machines, perf_event_paranoid above 2) available is false and reads are 0.
+using perfcounters_t =
+struct perfcounters {
+    enum { l1d, llc, dtlb, COUNT };
+    using values = std::array<uint64_t, COUNT>;
+
+    perfcounters(){
+#if defined(__linux__)
+        constexpr uint64_t readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const uint32_t types[COUNT] = {PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+        const uint64_t configs[COUNT] = {PERF_COUNT_HW_CACHE_L1D | readMiss, PERF_COUNT_HW_CACHE_MISSES,
+                                         PERF_COUNT_HW_CACHE_DTLB | readMiss};
+        fds.assign(omp_get_max_threads() * COUNT, -1);
+        // counters follow the thread that opens them, so each opens its own
+        #pragma omp parallel
+        for(int c = 0; c < COUNT; c++){
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[c];
+            attr.config = configs[c];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[omp_get_thread_num() * COUNT + c] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        available = true;
+        for(int fd : fds) available = available && fd >= 0;
+#endif
+    }
+    ~perfcounters(){
+#if defined(__linux__)
+        for(int fd : fds) if(fd >= 0) close(fd);
+#endif
+    }
+    perfcounters(const perfcounters&) = delete;
+    perfcounters& operator=(const perfcounters&) = delete;
+
+    // running totals; differences between two reads give what happened in between
+    values read() const {
+        values v = {};
+#if defined(__linux__)
+        if(!available) return v;
+        for(size_t i = 0; i < fds.size(); i++){
+            uint64_t n = 0;
+            if(::read(fds[i], &n, sizeof(n)) == sizeof(n)) v[i % COUNT] += n;
+        }
+#endif
+        return v;
+    }
+
+    bool available = false;
+
+private:
+    std::vector<int> fds; // COUNT per thread
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+#include "bench.hpp"
+#include "framebuffer.hpp"
+#include "geometry.hpp"
+
+// Blocking FIFO with a fixed capacity, the hand-off between the render thread
+// and the thread that presents. Closing wakes everyone: push then fails, pop
+// keeps draining what is left and fails once the queue is empty.
+template<typename T> struct boundedqueue {
+    explicit boundedqueue(size_t capacity) : capacity(capacity) {}
+
+    bool push(T value){
+        std::unique_lock lock(mutex);
+        notFull.wait(lock, [&]{ return closed || items.size() < capacity; });
+        if(closed) return false;
+        items.push_back(std::move(value));
+        notEmpty.notify_one();
+        return true;
+    }
+    bool pop(T& value){
+        std::unique_lock lock(mutex);
+        notEmpty.wait(lock, [&]{ return closed || !items.empty(); });
+        if(items.empty()) return false;
+        value = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    void close(){
+        std::lock_guard lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+    size_t capacity;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+    bool closed = false;
+};
+
+// One frame in flight: the camera and render scale it was requested with and
+// the image it became.
+using frameslot_t =
+struct frameslot {
+    explicit frameslot(int w, int h, int samples, bool tiled) : framebuffer(w, h, samples, tiled) {}
+
+    framebuffer_t framebuffer;
+    mat<float, 4, 4> viewproj = {};
+    double scale = 1.0; // per axis, see resolution.hpp
+    stats_t stats;
+};
@@ -0,0 +1,334 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "depthbuffer.hpp"
+#include "framebuffer.hpp"
+#include "geometry.hpp"
+#include "span.hpp"
+
+// Screen positions are 28.4 fixed point, SUBPIXEL steps to a pixel; pixel
+// (x, y) spans [x, x+1) x [y, y+1) and is sampled at its center.
+constexpr int SUBPIXEL_BITS = 4;
+constexpr int SUBPIXEL = 1 << SUBPIXEL_BITS;
+
+// Viewport-space vertex: position in subpixels plus depth in [0,1] as the
+// projection produced it (reversed when rendering to a reversed depth target).
+using screen_t =
+struct screen {
+    int32_t x, y;
+    float z;
+};
+
+// twice the signed area of a, b, c in subpixels squared, > 0 when clockwise on screen
+inline int64_t area2(const screen_t& a, const screen_t& b, const screen_t& c){
+    return int64_t{b.x-a.x}*(c.y-a.y) - int64_t{b.y-a.y}*(c.x-a.x);
+}
+
+// Edge function of the directed edge v0->v1 evaluated at p, in subpixels:
+//   E(p) = (v1.x-v0.x)*(p.y-v0.y) - (v1.y-v0.y)*(p.x-v0.x)
+// which is twice tArea(v0, v1, p). It needs 64 bits, but stepping a pixel adds
+// SUBPIXEL times a (or b) and leaves E mod SUBPIXEL alone, so the rasterizer
+// walks row = floor(E / SUBPIXEL) in 32 bits instead, adding a per pixel in x
+// and b per row. Its sign is E's, so row >= 0 is the fill test.
+using edge_t =
+struct edge {
+    int32_t a;      // dE/dx, per subpixel
+    int32_t b;      // dE/dy, per subpixel
+    int32_t bias;   // 0 on top/left edges, -1 otherwise, folded into E
+    int32_t rem;    // E mod SUBPIXEL, the same at every pixel center
+    int32_t row;    // floor(E / SUBPIXEL) at the start of the current row
+
+    edge() = default;
+    // E is taken at the center of pixel (x, y)
+    edge(const screen_t& v0, const screen_t& v1, int x, int y)
+        : a(v0.y - v1.y), b(v1.x - v0.x) {
+        // positive-area triangles wind clockwise on screen (y down): a top edge runs
+        // horizontally to the right, a left edge runs upwards
+        const bool topLeft = (a == 0 && b > 0) || a > 0;
+        bias = topLeft ? 0 : -1;
+        const int64_t e = int64_t{b} * (SUBPIXEL * y + SUBPIXEL / 2 - v0.y) +
+                          int64_t{a} * (SUBPIXEL * x + SUBPIXEL / 2 - v0.x) + bias;
+        row = static_cast<int32_t>(e >> SUBPIXEL_BITS);
+        rem = static_cast<int32_t>(e & (SUBPIXEL - 1));
+    }
+    // E at the first pixel, without the bias
+    int64_t exact() const { return int64_t{row} * SUBPIXEL + rem - bias; }
+};
+
+using triangle_t =
+struct triangle {
+    int xmin, xmax, ymin, ymax; // inclusive pixels, clipped to the target
+    int64_t area2;              // twice the signed area in subpixels, > 0 for front faces
+    edge_t e0, e1, e2;          // opposite a, b and c respectively
+    float z, dzdx, dzdy;        // depth plane at (xmin, ymin)
+    float zmin, zmax;           // depth range of the corners
+    uint32_t id;                // what a visibility pass writes for it, see visibility.hpp
+};
+
+// Varying planes for one triangle, set up like its depth: values at
+// (xmin, ymin) and steps per pixel in x and y.
+using varyings_t =
+struct varyings {
+    float v[VARYINGS], dx[VARYINGS], dy[VARYINGS];
+    int level; // mip level for the whole triangle
+};
+
+// work the hierarchical Z saved while rasterizing, and the pixels depth tested
+using occlusion_t =
+struct occlusion {
+    size_t triangles = 0; // triangle/tile pairs dropped before any pixel work
+    size_t blocks = 0;    // 8x8 blocks trimmed off the rows of large triangles
+    size_t fragments = 0; // pixels that passed the depth test
+    size_t tested = 0;    // pixels covered, passed or not
+    occlusion& operator+=(const occlusion& o){
+        triangles += o.triangles; blocks += o.blocks; fragments += o.fragments; tested += o.tested;
+        return *this;
+    }
+};
+
+// Triangle setup: returns false for back faces and triangles that cover no
+// sample of the target. Only sample points count, so thin and tiny triangles
+// are kept exactly when they hit one; samples is the target's per pixel, whose
+// positions reach past the pixel center.
+inline bool setupTriangle(const screen_t& a, const screen_t& b, const screen_t& c,
+                          int w, int h, triangle_t& t, int samples = 1){
+    t.area2 = area2(a, b, c);
+    if(t.area2 <= 0) return false; // backface & degenerate culling
+
+    // pixels with a sample inside the corners' bounds
+    const int reach = SUBPIXEL / 2 + (samples > 1 ? sampleReach : 0);
+    t.xmin = std::max((std::min({a.x, b.x, c.x}) - reach + SUBPIXEL - 1) >> SUBPIXEL_BITS, 0);
+    t.xmax = std::min((std::max({a.x, b.x, c.x}) - SUBPIXEL + reach) >> SUBPIXEL_BITS, w - 1);
+    t.ymin = std::max((std::min({a.y, b.y, c.y}) - reach + SUBPIXEL - 1) >> SUBPIXEL_BITS, 0);
+    t.ymax = std::min((std::max({a.y, b.y, c.y}) - SUBPIXEL + reach) >> SUBPIXEL_BITS, h - 1);
+    if(t.xmin > t.xmax || t.ymin > t.ymax) return false;
+
+    t.e0 = edge_t(b, c, t.xmin, t.ymin);
+    t.e1 = edge_t(c, a, t.xmin, t.ymin);
+    t.e2 = edge_t(a, b, t.xmin, t.ymin);
+
+    // z = α*a.z + β*b.z + γ*c.z as a plane in x/y, so the pixel loop only adds;
+    // set up in double from the exact edge values, which keeps float's precision
+    // for the depth itself on large and thin triangles alike
+    const double inv = 1.0 / static_cast<double>(t.area2);
+    t.dzdx = static_cast<float>((double(t.e0.a) * a.z + double(t.e1.a) * b.z + double(t.e2.a) * c.z) * SUBPIXEL * inv);
+    t.dzdy = static_cast<float>((double(t.e0.b) * a.z + double(t.e1.b) * b.z + double(t.e2.b) * c.z) * SUBPIXEL * inv);
+    t.z = static_cast<float>((static_cast<double>(t.e0.exact()) * a.z + static_cast<double>(t.e1.exact()) * b.z +
+                              static_cast<double>(t.e2.exact()) * c.z) * inv);
+    t.zmin = std::min({a.z, b.z, c.z});
+    t.zmax = std::max({a.z, b.z, c.z});
+    return true;
+}
+
+// Whether a triangle survives the cull mode, and whether b and c must trade
+// places so it reaches setupTriangle, which only takes positive area, the
+// right way round. Back face culling is setupTriangle's own.
+template<cull_t Cull>
+inline bool facing(const screen_t& a, const screen_t& b, const screen_t& c, bool& swap){
+    swap = false;
+    if constexpr (Cull == cull_t::back) return true;
+    swap = area2(a, b, c) < 0;
+    return Cull == cull_t::none || swap;
+}
+
+// Varying planes for a set-up triangle, corners in the order setupTriangle got
+// them, each holding 1/w followed by its attributes over w.
+inline void setupVaryings(const triangle_t& t, const float (&a)[VARYINGS], const float (&b)[VARYINGS],
+                          const float (&c)[VARYINGS], varyings_t& out){
+    const double inv = 1.0 / static_cast<double>(t.area2);
+    const double w0 = static_cast<double>(t.e0.exact()) * inv;
+    const double w1 = static_cast<double>(t.e1.exact()) * inv;
+    const double w2 = static_cast<double>(t.e2.exact()) * inv;
+    const double sx = SUBPIXEL * inv;
+    for(int k = 0; k < VARYINGS; k++){
+        out.dx[k] = static_cast<float>((double(t.e0.a) * a[k] + double(t.e1.a) * b[k] + double(t.e2.a) * c[k]) * sx);
+        out.dy[k] = static_cast<float>((double(t.e0.b) * a[k] + double(t.e1.b) * b[k] + double(t.e2.b) * c[k]) * sx);
+        out.v[k] = static_cast<float>(w0 * a[k] + w1 * b[k] + w2 * c[k]);
+    }
+}
+
+// Sample offsets of t on a target with the given samples per pixel (all zero at
+// 1x). Moving from the pixel center to a sample adds a*sx + b*sy to E, so the
+// sample's row value is the pixel's plus floor((rem + a*sx + b*sy) / SUBPIXEL).
+inline msaa_t sampleOffsets(const triangle_t& t, int samples){
+    msaa_t ms = {};
+    if(samples == 1) return ms;
+    auto offset = [](const edge_t& e, int k){
+        return (e.rem + e.a * samplePosition[k][0] + e.b * samplePosition[k][1]) >> SUBPIXEL_BITS;
+    };
+    for(int k = 0; k < SAMPLES; k++){
+        ms.o0[k] = offset(t.e0, k);
+        ms.o1[k] = offset(t.e1, k);
+        ms.o2[k] = offset(t.e2, k);
+        ms.dz[k] = (t.dzdx * static_cast<float>(samplePosition[k][0]) + t.dzdy * static_cast<float>(samplePosition[k][1])) /
+                   static_cast<float>(SUBPIXEL);
+    }
+    return ms;
+}
+
+// Rows y0..y1 of t between x0 and x1, which must lie inside its bounding box
+// and one tile of the targets, through pipeline P's span kernel, the multisampled one when the target has
+// samples. varyings is only read when P has any. Counts the pixels tested and passed.
+// Spans start their planes at origin (x0 when not given, never right of it),
+// so rows trimmed to a few blocks still get the values the whole row would.
+template<typename P, typename D>
+inline spancount_t rasterRows(const triangle_t& t, const varyings_t* varyings, const shading_t& shading, const msaa_t& ms,
+                       int x0, int y0, int x1, int y1, framebuffer_t& framebuffer, D& depthbuffer, int origin = -1){
+    if(origin < 0) origin = x0;
+    const int dx = origin - t.xmin, dy = y0 - t.ymin;
+    span_t s = {
+        t.e0.row + t.e0.a*dx + t.e0.b*dy,
+        t.e1.row + t.e1.a*dx + t.e1.b*dy,
+        t.e2.row + t.e2.a*dx + t.e2.b*dy,
+        t.e0.a, t.e1.a, t.e2.a,
+        0.0f, t.dzdx,
+        x1 - origin + 1, x0 - origin
+    };
+    const float zx = t.z + t.dzdx*dx;
+    const spanfn_t<D, P> kernel = spanFunction<D, P>(spanKernel.isa);
+    const msaafn_t<D, P> multisampled = msaaFunction<D, P>(spanKernel.isa);
+    const bool msaa = framebuffer.samples > 1;
+    shade_t sh;
+    sh.id = t.id;
+    sh.ambient = shading.ambient;
+    for(int k = 0; k < 3; k++) sh.light[k] = shading.light[k];
+    float vx[VARYINGS];
+    if constexpr (P::varying){
+        sh.texture = shading.texture->level(varyings->level);
+        for(int k = 0; k < VARYINGS; k++){
+            sh.dx[k] = varyings->dx[k];
+            vx[k] = varyings->v[k] + varyings->dx[k] * static_cast<float>(dx);
+        }
+    }
+    spancount_t count;
+    for(int y = y0; y <= y1; y++){
+        // depth and varyings restart from the plane every row so error never builds up across rows
+        s.z = zx + t.dzdy * static_cast<float>(y - t.ymin);
+        if constexpr (P::varying)
+            for(int k = 0; k < VARYINGS; k++) sh.v[k] = vx[k] + varyings->dy[k] * static_cast<float>(y - t.ymin);
+        if(msaa) count += multisampled(s, ms, sh, framebuffer.at(origin, y), framebuffer.sampleAt(origin, y),
+                                       framebuffer.expandedAt(origin, y), depthbuffer.at(origin, y));
+        else count += kernel(s, sh, framebuffer.at(origin, y), depthbuffer.at(origin, y));
+        s.w0 += t.e0.b; s.w1 += t.e1.b; s.w2 += t.e2.b;
+    }
+    return count;
+}
+
+// Rasterizes the part of t inside the inclusive rect [x0,x1]x[y0,y1], at most a
+// tile, against the depth target's hierarchical Z: the whole triangle is tested first, large ones
+// then band by band of blocks, and blocks it covers completely tighten the hiz.
+template<typename P, typename D>
+inline occlusion_t rasterRect(const triangle_t& t, const varyings_t* varyings, const shading_t& shading,
+                              int x0, int y0, int x1, int y1, framebuffer_t& framebuffer, D& depthbuffer){
+    x0 = std::max(x0, t.xmin); x1 = std::min(x1, t.xmax);
+    y0 = std::max(y0, t.ymin); y1 = std::min(y1, t.ymax);
+    if(x0 > x1 || y0 > y1) return {};
+
+    msaa_t ms = sampleOffsets(t, framebuffer.samples);
+    ms.depthPitch = depthbuffer.pitch;
+    ms.colorPitch = framebuffer.pitch * framebuffer.bpp;
+    hiz_t& hiz = depthbuffer.hiz;
+    if(!hiz.enabled || !P::state::depthTest){
+        // untested writes can leave depth farther than the bounds say
+        if constexpr (P::state::depthWrite) if(hiz.enabled) hiz.forget(x0, y0, x1, y1);
+        const spancount_t c = rasterRows<P>(t, varyings, shading, ms, x0, y0, x1, y1, framebuffer, depthbuffer);
+        return {0, 0, c.passed, c.tested};
+    }
+    constexpr int B = hiz_t::BLOCK;
+    const float sign = D::reversed ? -1.0f : 1.0f;
+    const float kz = sign * t.z, kdx = sign * t.dzdx, kdy = sign * t.dzdy;
+    const float reach = framebuffer.samples > 1 ? (std::abs(kdx) + std::abs(kdy)) * sampleReach / SUBPIXEL : 0.0f;
+
+    // The kernels don't test the plane's exact depth: they evaluate it in float
+    // from (xmin, ymin), a handful of roundings each worth up to an ulp of the
+    // largest term in play, which on thin triangles can be far above the depth
+    // itself; the block extremes below take as many again. Every bound read or
+    // written here is widened by that worst case, so it holds for what they test.
+    const float spanW = static_cast<float>(t.xmax - t.xmin + 1), spanH = static_cast<float>(t.ymax - t.ymin + 1);
+    const float slack = (std::abs(kz) + std::abs(kdx) * spanW + std::abs(kdy) * spanH + reach) *
+                        16.0f * std::numeric_limits<float>::epsilon();
+    const float nearest = hiz_t::key<D>(D::reversed ? t.zmax : t.zmin) - slack;
+    const float farthest = hiz_t::key<D>(D::reversed ? t.zmin : t.zmax) + slack;
+    if(hiz.occluded(x0, y0, x1, y1, nearest)) return {1, 0};
+
+    // Depth (as a key) and the edge functions are planes, so over a block each
+    // one is extreme at the corner its gradient's signs pick. That gives the
+    // block's nearest and farthest depth, and full coverage when every edge is
+    // still inside at its own worst corner. Blocks cut by the target use their
+    // full 8x8 corners, which only errs towards not covering. Samples reach
+    // sampleReach subpixels past the corners, which widens both by that much of the slopes,
+    // and coverage has to hold at the sample each edge is tightest at.
+    auto corner = [](auto slope, int b, int origin){ return b * B + (slope < 0 ? B - 1 : 0) - origin; };
+    auto extreme = [&](bool near, int bx, int by){
+        return kz + kdx * static_cast<float>(corner(near ? kdx : -kdx, bx, t.xmin))
+                  + kdy * static_cast<float>(corner(near ? kdy : -kdy, by, t.ymin)) + (near ? -reach - slack : reach + slack);
+    };
+    const int32_t s0 = *std::min_element(ms.o0, ms.o0 + SAMPLES);
+    const int32_t s1 = *std::min_element(ms.o1, ms.o1 + SAMPLES);
+    const int32_t s2 = *std::min_element(ms.o2, ms.o2 + SAMPLES);
+
+    // blocks lying wholly inside the rect, the last row and column may be cut by the target
+    const int cx0 = (x0 + B - 1) / B, cx1 = x1 == framebuffer.w - 1 ? x1 / B : (x1 + 1) / B - 1;
+    const int cy0 = (y0 + B - 1) / B, cy1 = y1 == framebuffer.h - 1 ? y1 / B : (y1 + 1) / B - 1;
+    if(P::state::occludes && cx0 <= cx1 && cy0 <= cy1){
+        auto worst = [&](const edge_t& e){ return e.row + e.a * corner(e.a, cx0, t.xmin) + e.b * corner(e.b, cy0, t.ymin); };
+        auto best = [&](const edge_t& e){ return e.row + e.a * corner(-e.a, cx0, t.xmin) + e.b * corner(-e.b, cy0, t.ymin); };
+        // pixels of block (bx, by) whose samples are all inside, bit y*B+x
+        auto mask = [&](int bx, int by){
+            uint64_t m = 0;
+            for(int y = 0; y < B; y++){
+                const int dx = bx * B - t.xmin, dy = by * B + y - t.ymin;
+                int32_t w0 = t.e0.row + t.e0.a * dx + t.e0.b * dy + s0;
+                int32_t w1 = t.e1.row + t.e1.a * dx + t.e1.b * dy + s1;
+                int32_t w2 = t.e2.row + t.e2.a * dx + t.e2.b * dy + s2;
+                for(int x = 0; x < B; x++){
+                    if((w0 | w1 | w2) >= 0) m |= uint64_t{1} << (y * B + x);
+                    w0 += t.e0.a; w1 += t.e1.a; w2 += t.e2.a;
+                }
+            }
+            return m;
+        };
+        int32_t r0 = worst(t.e0) + s0, r1 = worst(t.e1) + s1, r2 = worst(t.e2) + s2;
+        int32_t q0 = best(t.e0) + s0, q1 = best(t.e1) + s1, q2 = best(t.e2) + s2;
+        for(int by = cy0; by <= cy1; by++){
+            int32_t w0 = r0, w1 = r1, w2 = r2, v0 = q0, v1 = q1, v2 = q2;
+            for(int bx = cx0; bx <= cx1; bx++){
+                if((w0 | w1 | w2) >= 0) hiz.cover(bx, by, std::min(extreme(false, bx, by), farthest));
+                // an edge crosses the block: its pixels may complete it together with the neighbours'
+                else if((v0 | v1 | v2) >= 0) hiz.cover(bx, by, mask(bx, by), std::min(extreme(false, bx, by), farthest));
+                w0 += t.e0.a * B; w1 += t.e1.a * B; w2 += t.e2.a * B;
+                v0 += t.e0.a * B; v1 += t.e1.a * B; v2 += t.e2.a * B;
+            }
+            r0 += t.e0.b * B; r1 += t.e1.b * B; r2 += t.e2.b * B;
+            q0 += t.e0.b * B; q1 += t.e1.b * B; q2 += t.e2.b * B;
+        }
+    }
+
+    // Below a few blocks a side, testing blocks one by one costs more than the
+    // depth test it would save. Above, each band of rows is trimmed to its first
+    // and last visible block; holes in between are drawn anyway, splitting spans
+    // around them is dearer than the pixels.
+    if(x1 / B - x0 / B < 4 || y1 / B - y0 / B < 4){
+        const spancount_t c = rasterRows<P>(t, varyings, shading, ms, x0, y0, x1, y1, framebuffer, depthbuffer);
+        return {0, 0, c.passed, c.tested};
+    }
+    occlusion_t skipped;
+    for(int by = y0 / B; by <= y1 / B; by++){
+        const int ry0 = std::max(y0, by * B), ry1 = std::min(y1, by * B + B - 1);
+        auto visible = [&](int bx){ return std::max(extreme(true, bx, by), nearest) <= hiz.block(bx, by); };
+        int first = x0 / B, last = x1 / B;
+        while(first <= last && !visible(first)) first++;
+        while(last > first && !visible(last)) last--;
+        skipped.blocks += (x1 / B - x0 / B + 1) - std::max(last - first + 1, 0);
+        if(first > last) continue;
+        const spancount_t c = rasterRows<P>(t, varyings, shading, ms, std::max(x0, first * B), ry0,
+                                            std::min(x1, last * B + B - 1), ry1, framebuffer, depthbuffer, x0);
+        skipped.fragments += c.passed;
+        skipped.tested += c.tested;
+    }
+    return skipped;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+// Dynamic resolution: picks the render size each frame so the render cost holds
+// a frame time budget, and the image is stretched back to the window when it is
+// presented. Once culling and binning are paid, cost grows about linearly with
+// the pixel count, so the controller tracks a smoothed cost per unit of area
+// (scale squared) and picks the scale that area would fit the budget at. It
+// moves in steps of 1/32 per axis and only comes back up once the budget has
+// room for a whole step more, so a cost that hovers doesn't make the image pump.
+using resolution_t =
+struct resolution {
+    static constexpr double STEP = 1.0 / 32.0;
+    static constexpr double HEADROOM = 0.9; // aim under the budget, costs jitter
+    static constexpr double SMOOTHING = 0.25; // weight of the newest frame
+
+    double budget = 0.0; // ms, 0 renders at full size
+    double minScale = 0.25;
+    double scale = 1.0;  // per axis, for the next frame
+    double area = 0.0;   // smoothed ms per full-size frame, 0 until the first one
+
+    // feeds back the cost of a frame rendered at scale `at`; frames in flight
+    // report a scale older than the current one, hence the explicit argument
+    void update(double ms, double at){
+        if(budget <= 0.0 || at <= 0.0) return;
+        const double sample = ms / (at * at);
+        area = area > 0.0 ? area + (sample - area) * SMOOTHING : sample;
+        const double fit = std::sqrt(HEADROOM * budget / area);
+        const double down = std::floor(fit / STEP) * STEP;
+        if(down < scale) scale = down;
+        else if(down >= scale + STEP) scale += STEP;
+        scale = std::clamp(scale, minScale, 1.0);
+    }
+
+    bool missed(double ms) const { return budget > 0.0 && ms > budget; }
+
+    // render size along an axis of the given full size, kept even when scaled
+    static int size(int full, double scale){
+        if(scale >= 1.0) return full;
+        return std::max(16, static_cast<int>(full * scale + 0.5) & ~1);
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "geometry.hpp"
+#include "model.hpp"
+
+// An object placed in the scene: a model and where it goes, relative to an
+// earlier instance or to the world. Models are shared, so a thousand instances
+// of one mesh keep one copy of its vertices, attributes, bvh and levels of detail.
+using instance_t =
+struct instance {
+    uint32_t model;                // index into scene_t::models
+    int32_t parent = -1;           // earlier instance local is relative to, -1 for the world
+    mat<float, 4, 4> local = {};   // model to parent
+    mat<float, 4, 4> world = {};   // model to world, resolved by scene_t::update
+};
+
+// Flat scene graph: models and their instances, parents always before their
+// children, so one pass in order resolves every world transform.
+using scene_t =
+struct scene {
+    static constexpr mat<float, 4, 4> identity = {
+        1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 0,
+        0, 0, 0, 1,
+    };
+
+    uint32_t load(const std::string& path, bool cache = true){
+        models.emplace_back(path, cache);
+        return static_cast<uint32_t>(models.size() - 1);
+    }
+
+    // a model made in code rather than loaded
+    uint32_t load(model_t model){
+        models.push_back(std::move(model));
+        return static_cast<uint32_t>(models.size() - 1);
+    }
+
+    uint32_t add(uint32_t model, const mat<float, 4, 4>& local, int32_t parent = -1){
+        instances.push_back({model, parent, local, local});
+        return static_cast<uint32_t>(instances.size() - 1);
+    }
+
+    // world transforms from the local ones, after any of those changed
+    void update(){
+        for(instance_t& i : instances)
+            i.world = i.parent < 0 ? i.local : instances[i.parent].world * i.local;
+    }
+
+    std::vector<model_t> models;
+    std::vector<instance_t> instances;
+};
+
+// translation by t
+inline mat<float, 4, 4> translation(const vec<float, 3>& t){
+    mat<float, 4, 4> m = scene_t::identity;
+    m[0][3] = t[0];
+    m[1][3] = t[1];
+    m[2][3] = t[2];
+    return m;
+}
@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPAN_X86 1
+#endif
+
+#include "geometry.hpp"
+#include "texture.hpp"
+
+// Programmable stages, picked at compile time. A pipeline is a vertex shader,
+// a fragment shader and fixed-function state, all template parameters, so the
+// span kernels instantiated for it carry no per-pixel branches on any of them.
+
+// Varyings, in this order: 1/w, then every attribute over w. Both are planar
+// in screen space; a fragment divides the attributes by its 1/w.
+enum : int { varW, varU, varV, varNX, varNY, varNZ, varR, varG, varB, VARYINGS };
+
+// What fragment shaders get besides the pixel: varyings at the span's first
+// pixel and their x steps, the triangle's mip level and a directional light
+// (unit, towards the light, in the space the normals are in), and the
+// triangle's id for visibility passes.
+using shade_t =
+struct shade {
+    float v[VARYINGS], dx[VARYINGS];
+    miplevel_t texture;
+    float light[3];
+    float ambient;
+    uint32_t id;
+};
+
+// What vertex shaders read: the mesh's per-vertex attributes and texture, each
+// instance's rotation of its normals into the world, and the light.
+using shading_t =
+struct shading {
+    const vec<float, 2>* uvs;
+    const vec<float, 3>* normals;   // model space
+    const vec<float, 3>* colors;
+    const texture_t* texture;
+    const mat<float, 3, 3>* rotations; // per instance, model to world
+    vec<float, 3> light; // world space, unit, towards the light
+    float ambient;
+};
+
+enum class blend_t { none, add, alpha }; // alpha: src*a + dst*(1-a) on every channel
+enum class cull_t { back, front, none };
+
+template<bool DepthTest = true, bool DepthWrite = true, blend_t Blend = blend_t::none, cull_t Cull = cull_t::back>
+struct pipelinestate {
+    static constexpr bool depthTest = DepthTest;
+    static constexpr bool depthWrite = DepthWrite;
+    static constexpr blend_t blend = Blend;
+    static constexpr cull_t cull = Cull;
+    // what the hierarchical z may assume: tested fragments are hidden by nearer
+    // depth, and drawn ones hide what is behind them
+    static constexpr bool occludes = DepthTest && DepthWrite && Blend == blend_t::none;
+};
+
+// Vertex shaders hand the varyings the attributes of vertex i of an instance
+// (varyings after varW, not yet over w). Positions are transformed by the
+// vertex stage's fixed mvp loop.
+using novertex_t =
+struct novertex {
+    static constexpr bool varying = false; // no varyings, triangles skip their plane setup
+    static void attributes(const shading_t&, size_t, uint32_t, float*){}
+};
+
+using meshvertex_t =
+struct meshvertex {
+    static constexpr bool varying = true;
+    static void attributes(const shading_t& s, size_t i, uint32_t instance, float* out){
+        const vec<float, 3> n = s.rotations[instance] * s.normals[i];
+        const float attr[VARYINGS - 1] = {s.uvs[i][0], s.uvs[i][1],
+                                          n[0], n[1], n[2],
+                                          s.colors[i][0], s.colors[i][1], s.colors[i][2]};
+        std::copy(std::begin(attr), std::end(attr), out);
+    }
+};
+
+// Fragment shaders return RGBA32 for pixels that passed the depth test, from
+// the clamped depth and the pixel's offset i into the span. Each has a scalar
+// and an AVX2 version, those with hasSSE4 an SSE4.1 one too (the rest run
+// scalar there). color = false writes depth only.
+inline float varying(const shade_t& sh, int k, int i){ return sh.v[k] + sh.dx[k] * static_cast<float>(i); }
+
+// ambient plus lambert, times w; the normal isn't divided by w, normalizing takes care of that
+inline float lambert(const shade_t& sh, int i, float w){
+    const float nx = varying(sh, varNX, i), ny = varying(sh, varNY, i), nz = varying(sh, varNZ, i);
+    const float n2 = nx*nx + ny*ny + nz*nz;
+    const float ndl = nx*sh.light[0] + ny*sh.light[1] + nz*sh.light[2];
+    return (sh.ambient + (1.0f - sh.ambient) * std::max(ndl, 0.0f) / std::sqrt(std::max(n2, 1e-30f))) * w;
+}
+
+#ifdef SPAN_X86
+// varying k at pixels x (offsets from the span start)
+__attribute__((target("avx2")))
+inline __m256 varyingAVX2(const shade_t& sh, int k, __m256 x){
+    return _mm256_add_ps(_mm256_set1_ps(sh.v[k]), _mm256_mul_ps(x, _mm256_set1_ps(sh.dx[k])));
+}
+
+__attribute__((target("avx2")))
+inline __m256 lambertAVX2(const shade_t& sh, __m256 x, __m256 w){
+    const __m256 nx = varyingAVX2(sh, varNX, x), ny = varyingAVX2(sh, varNY, x), nz = varyingAVX2(sh, varNZ, x);
+    const __m256 n2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz));
+    const __m256 ndl = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_set1_ps(sh.light[0])),
+                                                   _mm256_mul_ps(ny, _mm256_set1_ps(sh.light[1]))),
+                                     _mm256_mul_ps(nz, _mm256_set1_ps(sh.light[2])));
+    // a true square root and divide, in lambert's order, so every ISA shades alike
+    const __m256 diff = _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(1.0f - sh.ambient), _mm256_max_ps(ndl, _mm256_setzero_ps())),
+                                      _mm256_sqrt_ps(_mm256_max_ps(n2, _mm256_set1_ps(1e-30f))));
+    return _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(sh.ambient), diff), w);
+}
+
+__attribute__((target("avx2")))
+inline __m256 offsetsAVX2(int i){
+    return _mm256_add_ps(_mm256_set1_ps(static_cast<float>(i)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+}
+#endif
+
+// depth only, for z prepasses
+using nofragment_t =
+struct nofragment {
+    static constexpr bool color = false;
+    static constexpr bool hasSSE4 = true;
+};
+
+// gray from depth, brighter is farther regardless of the depth direction
+using depthfragment_t =
+struct depthfragment {
+    static constexpr bool color = true;
+    static constexpr bool hasSSE4 = true;
+
+    template<typename D>
+    static uint32_t scalar(const shade_t&, float z, int){
+        z = std::clamp(z, 0.0f, 1.0f);
+        const uint32_t g = static_cast<uint32_t>((D::reversed ? 1.0f - z : z) * 255.0f);
+        return g * 0x01010101u;
+    }
+#ifdef SPAN_X86
+    template<typename D>
+    __attribute__((target("sse4.1")))
+    static __m128i sse4(const shade_t&, __m128 zc, int){
+        const __m128 g = _mm_mul_ps(D::reversed ? _mm_sub_ps(_mm_set1_ps(1.0f), zc) : zc, _mm_set1_ps(255.0f));
+        return _mm_mullo_epi32(_mm_cvttps_epi32(g), _mm_set1_epi32(0x01010101));
+    }
+    template<typename D>
+    __attribute__((target("avx2")))
+    static __m256i avx2(const shade_t&, __m256 zc, int, __m256i){
+        const __m256 g = _mm256_mul_ps(D::reversed ? _mm256_sub_ps(_mm256_set1_ps(1.0f), zc) : zc, _mm256_set1_ps(255.0f));
+        return _mm256_mullo_epi32(_mm256_cvttps_epi32(g), _mm256_set1_epi32(0x01010101));
+    }
+#endif
+};
+
+// vertex color under the light
+using litfragment_t =
+struct litfragment {
+    static constexpr bool color = true;
+    static constexpr bool hasSSE4 = false;
+
+    template<typename D>
+    static uint32_t scalar(const shade_t& sh, float, int i){
+        const float w = 1.0f / varying(sh, varW, i);
+        const float lit = lambert(sh, i, w) * 255.0f;
+        uint32_t rgba = 0xFF000000u;
+        for(int c = 0; c < 3; c++)
+            rgba |= static_cast<uint32_t>(std::min(varying(sh, varR + c, i) * lit, 255.0f)) << (8 * c);
+        return rgba;
+    }
+#ifdef SPAN_X86
+    template<typename D>
+    __attribute__((target("avx2")))
+    static __m256i avx2(const shade_t& sh, __m256, int i, __m256i){
+        const __m256 x = offsetsAVX2(i);
+        const __m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), varyingAVX2(sh, varW, x));
+        const __m256 lit = _mm256_mul_ps(lambertAVX2(sh, x, w), _mm256_set1_ps(255.0f));
+        __m256i rgba = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+        for(int c = 0; c < 3; c++){
+            const __m256 k = _mm256_min_ps(_mm256_mul_ps(varyingAVX2(sh, varR + c, x), lit), _mm256_set1_ps(255.0f));
+            rgba = _mm256_or_si256(rgba, _mm256_slli_epi32(_mm256_cvttps_epi32(k), 8 * c));
+        }
+        return rgba;
+    }
+#endif
+};
+
+// texel times vertex color under the light; nearest texel of the triangle's mip level
+using texturedfragment_t =
+struct texturedfragment {
+    static constexpr bool color = true;
+    static constexpr bool hasSSE4 = false;
+
+    template<typename D>
+    static uint32_t scalar(const shade_t& sh, float, int i){
+        const float w = 1.0f / varying(sh, varW, i);
+        const float u = std::clamp(varying(sh, varU, i) * w * static_cast<float>(sh.texture.w), -1e6f, 1e6f);
+        const float t = std::clamp(varying(sh, varV, i) * w * static_cast<float>(sh.texture.h), -1e6f, 1e6f);
+        const uint32_t texel = sh.texture.fetch(static_cast<int>(std::floor(u)), static_cast<int>(std::floor(t)));
+        const float lit = lambert(sh, i, w);
+        uint32_t rgba = 0xFF000000u;
+        for(int c = 0; c < 3; c++){
+            const float k = static_cast<float>((texel >> (8 * c)) & 0xFF) * varying(sh, varR + c, i) * lit;
+            rgba |= static_cast<uint32_t>(std::min(k, 255.0f)) << (8 * c);
+        }
+        return rgba;
+    }
+#ifdef SPAN_X86
+    // texels come in with one gather masked to the lanes that passed
+    template<typename D>
+    __attribute__((target("avx2")))
+    static __m256i avx2(const shade_t& sh, __m256, int i, __m256i pass){
+        const __m256 x = offsetsAVX2(i);
+        const __m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), varyingAVX2(sh, varW, x));
+
+        // texel address in the blocked layout, out of range floats wrap like any other
+        const __m256 tw = _mm256_set1_ps(static_cast<float>(sh.texture.w)), th = _mm256_set1_ps(static_cast<float>(sh.texture.h));
+        const __m256i three = _mm256_set1_epi32(3);
+        const __m256i tx = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(_mm256_mul_ps(varyingAVX2(sh, varU, x), w), tw))),
+                                            _mm256_set1_epi32(sh.texture.w - 1));
+        const __m256i ty = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(_mm256_mul_ps(varyingAVX2(sh, varV, x), w), th))),
+                                            _mm256_set1_epi32(sh.texture.h - 1));
+        const __m256i block = _mm256_add_epi32(_mm256_sll_epi32(_mm256_srli_epi32(ty, 2), _mm_cvtsi32_si128(sh.texture.shift)),
+                                               _mm256_srli_epi32(tx, 2));
+        const __m256i addr = _mm256_or_si256(_mm256_slli_epi32(block, 4),
+            _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(ty, three), 2), _mm256_and_si256(tx, three)));
+        const __m256i texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+            reinterpret_cast<const int*>(sh.texture.texels), addr, pass, 4);
+
+        const __m256 lit = lambertAVX2(sh, x, w);
+        __m256i rgba = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+        for(int c = 0; c < 3; c++){
+            const __m256 t = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8 * c), _mm256_set1_epi32(0xFF)));
+            const __m256 k = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(t, varyingAVX2(sh, varR + c, x)), lit), _mm256_set1_ps(255.0f));
+            rgba = _mm256_or_si256(rgba, _mm256_slli_epi32(_mm256_cvttps_epi32(k), 8 * c));
+        }
+        return rgba;
+    }
+#endif
+};
+
+// the triangle's id as the color, for the raster pass of visibility.hpp
+using idfragment_t =
+struct idfragment {
+    static constexpr bool color = true;
+    static constexpr bool hasSSE4 = true;
+
+    template<typename D>
+    static uint32_t scalar(const shade_t& sh, float, int){ return sh.id; }
+#ifdef SPAN_X86
+    template<typename D>
+    __attribute__((target("sse4.1")))
+    static __m128i sse4(const shade_t& sh, __m128, int){ return _mm_set1_epi32(static_cast<int>(sh.id)); }
+    template<typename D>
+    __attribute__((target("avx2")))
+    static __m256i avx2(const shade_t& sh, __m256, int, __m256i){ return _mm256_set1_epi32(static_cast<int>(sh.id)); }
+#endif
+};
+
+template<typename Vertex, typename Fragment, typename State = pipelinestate<>>
+struct pipeline {
+    using vertex = Vertex;
+    using fragment = Fragment;
+    using state = State;
+    static constexpr bool varying = Vertex::varying;
+};
+
+// the ones the renderer picks from at run time
+using depthonly_t = pipeline<novertex_t, nofragment_t>;
+using flat_t      = pipeline<novertex_t, depthfragment_t>;
+using lit_t       = pipeline<meshvertex_t, litfragment_t>;
+using textured_t  = pipeline<meshvertex_t, texturedfragment_t>;
+
+// the visibility pass for P: its depth and cull state, ids instead of shading
+template<typename P>
+using idpass_t = pipeline<novertex_t, idfragment_t, typename P::state>;
+template<typename P>
+constexpr bool namesTriangles = std::is_same_v<typename P::fragment, idfragment_t>;
@@ -0,0 +1,290 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "geometry.hpp"
+
+// Error quadric (Garland/Heckbert): sum of squared distances to a set of planes,
+// each weighted, as x^T A x + 2 b.x + c. w is the total weight, so eval()/w is
+// a mean squared distance.
+using quadric_t =
+struct quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+    double b0 = 0, b1 = 0, b2 = 0, c = 0, w = 0;
+
+    // unit normal n, plane n.x + d = 0
+    static quadric plane(const vec<double, 3>& n, double d, double weight){
+        quadric q;
+        q.a00 = weight * n[0] * n[0]; q.a01 = weight * n[0] * n[1]; q.a02 = weight * n[0] * n[2];
+        q.a11 = weight * n[1] * n[1]; q.a12 = weight * n[1] * n[2]; q.a22 = weight * n[2] * n[2];
+        q.b0 = weight * n[0] * d; q.b1 = weight * n[1] * d; q.b2 = weight * n[2] * d;
+        q.c = weight * d * d;
+        q.w = weight;
+        return q;
+    }
+    quadric& operator+=(const quadric& o){
+        a00 += o.a00; a01 += o.a01; a02 += o.a02; a11 += o.a11; a12 += o.a12; a22 += o.a22;
+        b0 += o.b0; b1 += o.b1; b2 += o.b2; c += o.c; w += o.w;
+        return *this;
+    }
+    double eval(const vec<float, 3>& p) const {
+        const double x = p[0], y = p[1], z = p[2];
+        const double e = a00*x*x + a11*y*y + a22*z*z + 2.0 * (a01*x*y + a02*x*z + a12*y*z)
+                       + 2.0 * (b0*x + b1*y + b2*z) + c;
+        return std::max(e, 0.0);
+    }
+};
+
+// Quadric error mesh simplification by half-edge collapses: a vertex only ever
+// moves onto a neighbour, so every level keeps indexing the input's vertices and
+// their uvs, normals and colors untouched. Vertices are the welded corners the
+// loader makes, so one position can carry several (a uv or normal seam); those
+// only collapse along their seam, both sides at once, and vertices on open
+// borders or where seams meet stay put. Each pass picks the cheapest collapses
+// that don't touch each other's one-rings, so the quadrics a pass reads are
+// never stale, and drops faces that went degenerate.
+//
+// reduce() can be called with falling targets to take one level of detail after
+// the other from the same run; error() is the farthest (root mean square over a
+// vertex's planes) any collapse so far moved the surface, in model units.
+using simplifier_t =
+struct simplifier {
+    // faces are 1-based indices into vertices
+    simplifier(const std::vector<vec<float, 3>>& vertices, const std::vector<vec<uint32_t, 3>>& faces) : vertices(vertices) {
+        const uint32_t n = static_cast<uint32_t>(vertices.size());
+        indices.reserve(faces.size() * 3);
+        for(const auto& f : faces)
+            for(size_t k = 0; k < 3; k++) indices.push_back(f[k] - 1);
+
+        // vertices at the same position share the first one's quadric, sibling
+        // links the ones at a position in a ring
+        position.resize(n);
+        sibling.resize(n);
+        std::vector<uint32_t> order(n);
+        std::iota(order.begin(), order.end(), 0u);
+        auto less = [&](uint32_t a, uint32_t b){
+            const auto &p = vertices[a], &q = vertices[b];
+            return p[0] != q[0] ? p[0] < q[0] : p[1] != q[1] ? p[1] < q[1] : p[2] != q[2] ? p[2] < q[2] : a < b;
+        };
+        std::sort(order.begin(), order.end(), less);
+        for(uint32_t i = 0, j; i < n; i = j){
+            for(j = i + 1; j < n && vertices[order[j]].data == vertices[order[i]].data; j++);
+            for(uint32_t k = i; k < j; k++){
+                position[order[k]] = order[i];
+                sibling[order[k]] = order[k + 1 < j ? k + 1 : i];
+            }
+        }
+
+        // each face's plane, by area, into its corners' positions; edges without
+        // a reverse (borders and seams) add a plane through them upright on the
+        // face, so collapses along them keep the line where they'd bend it
+        std::vector<uint64_t> edges;
+        edges.reserve(indices.size());
+        for(size_t f = 0; f < indices.size(); f += 3)
+            for(size_t k = 0; k < 3; k++) edges.push_back(key(indices[f+k], indices[f + (k+1) % 3]));
+        std::sort(edges.begin(), edges.end());
+        quadrics.resize(n);
+        for(size_t f = 0; f < indices.size(); f += 3){
+            const vec<double, 3> p[3] = {point(indices[f]), point(indices[f+1]), point(indices[f+2])};
+            const vec<double, 3> normal = (p[1] - p[0]).cross(p[2] - p[0]);
+            const double area2 = normal.length();
+            if(area2 <= 0.0) continue;
+            const vec<double, 3> unit = normal / area2;
+            const quadric_t q = quadric_t::plane(unit, -unit.dot(p[0]), area2 * 0.5);
+            for(size_t k = 0; k < 3; k++){
+                quadrics[position[indices[f+k]]] += q;
+                const uint32_t a = indices[f+k], b = indices[f + (k+1) % 3];
+                if(std::binary_search(edges.begin(), edges.end(), key(b, a))) continue;
+                const vec<double, 3> along = p[(k+1) % 3] - p[k];
+                const vec<double, 3> side = along.cross(unit);
+                const double length = side.length();
+                if(length <= 0.0) continue;
+                const quadric_t e = quadric_t::plane(side / length, -(side / length).dot(p[k]), EDGE_WEIGHT * length * length);
+                quadrics[position[a]] += e;
+                quadrics[position[b]] += e;
+            }
+        }
+    }
+
+    // collapses until at most target faces are left or nothing more can go;
+    // returns the faces, 1-based like the input's
+    std::vector<vec<uint32_t, 3>> reduce(size_t target){
+        while(indices.size() / 3 > target && pass(target));
+        std::vector<vec<uint32_t, 3>> out(indices.size() / 3);
+        for(size_t f = 0; f < out.size(); f++)
+            out[f] = {indices[3*f] + 1, indices[3*f+1] + 1, indices[3*f+2] + 1};
+        return out;
+    }
+
+    float error() const { return static_cast<float>(std::sqrt(worst)); }
+
+private:
+    enum : uint8_t { manifold, seam, locked };
+    static constexpr double EDGE_WEIGHT = 10.0; // how hard seams and borders hold their line
+    static constexpr double FLIP_COS = 0.25;    // faces may turn by up to ~75 degrees
+
+    struct collapse {
+        uint32_t from, to;
+        uint32_t siblingFrom, siblingTo; // the other side of a seam, from == to when none
+        double error;
+    };
+
+    vec<double, 3> point(uint32_t v) const { return {vertices[v][0], vertices[v][1], vertices[v][2]}; }
+
+    static uint64_t key(uint32_t a, uint32_t b){ return uint64_t{a} << 32 | b; }
+
+    bool pass(size_t target){
+        const uint32_t n = static_cast<uint32_t>(vertices.size());
+        const size_t count = indices.size() / 3;
+
+        // directed edges, by vertex and by position; an edge without its reverse is open
+        std::vector<uint64_t> edges, positionEdges;
+        edges.reserve(indices.size());
+        positionEdges.reserve(indices.size());
+        for(size_t f = 0; f < indices.size(); f += 3)
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t a = indices[f+k], b = indices[f + (k+1) % 3];
+                edges.push_back(key(a, b));
+                positionEdges.push_back(key(position[a], position[b]));
+            }
+        std::sort(edges.begin(), edges.end());
+        std::sort(positionEdges.begin(), positionEdges.end());
+        auto has = [](const std::vector<uint64_t>& set, uint64_t k){ return std::binary_search(set.begin(), set.end(), k); };
+
+        // faces around each position
+        std::vector<uint32_t> first(n + 1, 0), around(indices.size());
+        for(uint32_t v : indices) first[position[v] + 1]++;
+        for(uint32_t p = 0; p < n; p++) first[p + 1] += first[p];
+        std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+        for(size_t i = 0; i < indices.size(); i++) around[fill[position[indices[i]]]++] = static_cast<uint32_t>(i / 3);
+
+        // a seam vertex has one sibling and one open edge out and one in, each
+        // matched across the seam; anything else with siblings, or on a border, is locked
+        std::vector<uint8_t> kind(n, manifold);
+        std::vector<uint32_t> openOut(n, ~0u), openIn(n, ~0u);
+        std::vector<uint8_t> outs(n, 0), ins(n, 0);
+        for(size_t f = 0; f < indices.size(); f += 3)
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t a = indices[f+k], b = indices[f + (k+1) % 3];
+                if(!has(positionEdges, key(position[b], position[a]))){
+                    kind[position[a]] = kind[position[b]] = locked;
+                    continue;
+                }
+                if(has(edges, key(b, a))) continue;
+                openOut[a] = b; outs[a]++;
+                openIn[b] = a; ins[b]++;
+            }
+        for(uint32_t v = 0; v < n; v++){
+            const uint32_t p = position[v];
+            if(kind[p] == locked) continue;
+            if(sibling[v] == v) continue;
+            if(sibling[sibling[v]] != v || outs[v] != 1 || ins[v] != 1) kind[p] = locked;
+            else kind[p] = seam;
+        }
+
+        std::vector<collapse> candidates;
+        for(size_t f = 0; f < indices.size(); f += 3)
+            for(size_t k = 0; k < 3; k++)
+                for(int dir = 0; dir < 2; dir++){
+                    const uint32_t a = indices[f + (dir ? (k+1) % 3 : k)], b = indices[f + (dir ? k : (k+1) % 3)];
+                    collapse c = {a, b, a, a, 0.0};
+                    if(kind[position[a]] == seam){
+                        // along the seam only: a's open edge to or from b, and its
+                        // sibling's matching edge to or from b's sibling
+                        const uint32_t s = sibling[a];
+                        if(openOut[a] == b && openIn[s] != ~0u && position[openIn[s]] == position[b]) c.siblingTo = openIn[s];
+                        else if(openIn[a] == b && openOut[s] != ~0u && position[openOut[s]] == position[b]) c.siblingTo = openOut[s];
+                        else continue;
+                        c.siblingFrom = s;
+                    } else if(kind[position[a]] != manifold) continue;
+                    c.error = quadrics[position[a]].eval(vertices[b]) / std::max(quadrics[position[a]].w, 1e-30);
+                    candidates.push_back(c);
+                }
+        std::sort(candidates.begin(), candidates.end(), [](const collapse& a, const collapse& b){ return a.error < b.error; });
+
+        std::vector<uint8_t> touched(n, 0);
+        std::vector<uint32_t> remap(n);
+        std::iota(remap.begin(), remap.end(), 0u);
+        std::vector<uint32_t> ring;
+        size_t removed = 0, applied = 0;
+        for(const collapse& c : candidates){
+            if(count - removed <= target) break;
+            const uint32_t pa = position[c.from], pb = position[c.to];
+            if(touched[pa] || touched[pb]) continue;
+            if(!linkHolds(pa, pb, first, around, ring) || flips(c, pa, pb, first, around)) continue;
+
+            for(uint32_t i = first[pa]; i < first[pa + 1]; i++)
+                for(size_t k = 0; k < 3; k++) touched[position[indices[3 * around[i] + k]]] = 1;
+            remap[c.from] = c.to;
+            if(c.siblingFrom != c.from) remap[c.siblingFrom] = c.siblingTo;
+            quadrics[pb] += quadrics[pa];
+            worst = std::max(worst, c.error);
+            removed += 2;
+            applied++;
+        }
+        if(!applied) return false;
+
+        size_t m = 0;
+        for(size_t f = 0; f < indices.size(); f += 3){
+            const uint32_t a = remap[indices[f]], b = remap[indices[f+1]], c = remap[indices[f+2]];
+            if(position[a] == position[b] || position[b] == position[c] || position[a] == position[c]) continue;
+            indices[m++] = a; indices[m++] = b; indices[m++] = c;
+        }
+        indices.resize(m);
+        return true;
+    }
+
+    // an edge may only collapse when its ends share exactly the two neighbours
+    // of the faces on it, or the mesh pinches
+    bool linkHolds(uint32_t pa, uint32_t pb, const std::vector<uint32_t>& first,
+                   const std::vector<uint32_t>& around, std::vector<uint32_t>& ring) const {
+        ring.clear();
+        for(uint32_t i = first[pa]; i < first[pa + 1]; i++)
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t p = position[indices[3 * around[i] + k]];
+                if(p != pa && p != pb) ring.push_back(p);
+            }
+        std::sort(ring.begin(), ring.end());
+        ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+        size_t shared = 0;
+        for(uint32_t i = first[pb]; i < first[pb + 1]; i++)
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t p = position[indices[3 * around[i] + k]];
+                if(p == pa || p == pb) continue;
+                auto it = std::lower_bound(ring.begin(), ring.end(), p);
+                if(it != ring.end() && *it == p){ shared++; ring.erase(it); }
+            }
+        return shared <= 2;
+    }
+
+    // true when moving pa onto pb turns a surviving face too far or inverts it
+    bool flips(const collapse& c, uint32_t pa, uint32_t pb, const std::vector<uint32_t>& first,
+               const std::vector<uint32_t>& around) const {
+        for(uint32_t i = first[pa]; i < first[pa + 1]; i++){
+            const uint32_t* f = &indices[3 * around[i]];
+            vec<double, 3> p[3], q[3];
+            bool gone = false;
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t pos = position[f[k]];
+                gone = gone || pos == pb;
+                p[k] = point(f[k]);
+                q[k] = pos == pa ? point(c.to) : p[k];
+            }
+            if(gone) continue;
+            const vec<double, 3> before = (p[1] - p[0]).cross(p[2] - p[0]);
+            const vec<double, 3> after = (q[1] - q[0]).cross(q[2] - q[0]);
+            if(before.dot(after) <= FLIP_COS * before.length() * after.length()) return true;
+        }
+        return false;
+    }
+
+    const std::vector<vec<float, 3>>& vertices;
+    std::vector<uint32_t> indices;  // 0-based, three per face
+    std::vector<uint32_t> position; // first vertex at the same position
+    std::vector<uint32_t> sibling;  // next vertex at the same position, itself when alone
+    std::vector<quadric_t> quadrics; // by position
+    double worst = 0.0;
+};
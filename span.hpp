@@ -0,0 +1,533 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "shader.hpp"
+
+// One row of a triangle: edge values and depth at the row's origin plus their
+// per-pixel x steps. Kernels test coverage, depth-test and write pixels first
+// to n-1 from the given row pointers (RGBA32 color, one D::value_type depth),
+// and count the pixels they depth tested and those that passed (the fragments
+// shaded, when P has color). Pixel i's depth is always z + dzdx*i and its
+// varyings the shade's at i, whichever kernel gets it, so where a span starts
+// or splits never changes what a pixel gets.
+// Every kernel is instantiated per pipeline P; its state and fragment shader
+// are resolved at compile time.
+using span_t =
+struct span {
+    int32_t w0, w1, w2;
+    int32_t a0, a1, a2;
+    float z, dzdx;
+    int n;
+    int first = 0;
+};
+
+using spancount_t =
+struct spancount {
+    uint32_t tested = 0, passed = 0;
+    spancount operator+(const spancount& o) const { return {tested + o.tested, passed + o.passed}; }
+    spancount& operator+=(const spancount& o){ return *this = *this + o; }
+};
+
+template<typename D, typename P>
+using spanfn_t = spancount_t (*)(const span_t&, const shade_t&, uint8_t* color, typename D::value_type* depth);
+
+// 4x multisampling. Samples sit on the rotated grid D3D uses, in subpixels
+// (1/16) from the pixel center, which is where 1x samples and MSAA shades.
+constexpr int SAMPLES = 4;
+constexpr int samplePosition[SAMPLES][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+constexpr int sampleReach = 6; // farthest any of them lies from the center on either axis
+
+// What a multisampled span adds to span_t: each sample's offset from the pixel's
+// edge values and depth, constant over the triangle, and the strides between
+// sample planes. Kernels get the pixel's color, its sample 0 color and depth,
+// and the expanded flags (see framebuffer_t). They count a pixel as tested
+// when any of its samples was, and as passed when any of them passed.
+using msaa_t =
+struct msaa {
+    int32_t o0[SAMPLES], o1[SAMPLES], o2[SAMPLES];
+    float dz[SAMPLES];
+    int depthPitch; // depth elements from one sample to the next
+    int colorPitch; // color bytes from one sample to the next
+};
+
+template<typename D, typename P>
+using msaafn_t = spancount_t (*)(const span_t&, const msaa_t&, const shade_t&, uint8_t* color, uint8_t* samples,
+                          uint8_t* expanded, typename D::value_type* depth);
+
+template<blend_t B>
+inline uint32_t blendScalar(uint32_t src, const uint8_t* dst){
+    if constexpr (B == blend_t::none) return src;
+    uint32_t d;
+    memcpy(&d, dst, 4);
+    uint32_t out = 0;
+    for(int c = 0; c < 32; c += 8){
+        const uint32_t s = (src >> c) & 0xFF, t = (d >> c) & 0xFF;
+        uint32_t v;
+        if constexpr (B == blend_t::add) v = std::min(s + t, 255u);
+        else {
+            const uint32_t a = src >> 24, x = s * a + t * (255 - a) + 128;
+            v = (x + (x >> 8)) >> 8; // x / 255, rounded
+        }
+        out |= v << c;
+    }
+    return out;
+}
+
+template<typename D, typename P>
+inline spancount_t spanScalar(const span_t& s, const shade_t& sh, uint8_t* color, typename D::value_type* depth){
+    using S = typename P::state;
+    using F = typename P::fragment;
+    int32_t w0 = s.w0 + s.a0*s.first, w1 = s.w1 + s.a1*s.first, w2 = s.w2 + s.a2*s.first;
+    spancount_t count;
+    for(int i = s.first; i < s.n; i++){
+        const float z = s.z + s.dzdx * static_cast<float>(i);
+        if((w0 | w1 | w2) >= 0){
+            count.tested++;
+            const typename D::value_type d = D::quantize(z);
+            if(!S::depthTest || D::test(d, depth[i])){
+                count.passed++;
+                if constexpr (S::depthWrite) depth[i] = d;
+                if constexpr (F::color){
+                    const uint32_t rgba = blendScalar<S::blend>(F::template scalar<D>(sh, z, i), color + i*4);
+                    memcpy(color + i*4, &rgba, 4);
+                }
+            }
+        }
+        w0 += s.a0; w1 += s.a1; w2 += s.a2;
+    }
+    return count;
+}
+
+// finishes a span from pixel i on with the scalar kernel
+template<typename D, typename P>
+inline spancount_t spanTail(const span_t& s, const shade_t& sh, int i, uint8_t* color, typename D::value_type* depth){
+    if(i >= s.n) return {};
+    span_t t = s;
+    t.first = i;
+    return spanScalar<D, P>(t, sh, color, depth);
+}
+
+// Multisampled span: coverage and depth per sample, the fragment shaded once
+// per pixel. A pixel whose samples all pass takes the color whole and goes back
+// to compressed (with blending only if it was not expanded); any other pixel is
+// expanded first and then written sample by sample.
+template<typename D, typename P>
+inline spancount_t spanMSAAScalar(const span_t& s, const msaa_t& ms, const shade_t& sh, uint8_t* color, uint8_t* samples,
+                                  uint8_t* expanded, typename D::value_type* depth){
+    using S = typename P::state;
+    using F = typename P::fragment;
+    int32_t w0 = s.w0 + s.a0*s.first, w1 = s.w1 + s.a1*s.first, w2 = s.w2 + s.a2*s.first;
+    spancount_t count;
+    for(int i = s.first; i < s.n; i++){
+        const float z = s.z + s.dzdx * static_cast<float>(i);
+        int covered = 0, pass = 0;
+        for(int k = 0; k < SAMPLES; k++){
+            if(((w0 + ms.o0[k]) | (w1 + ms.o1[k]) | (w2 + ms.o2[k])) < 0) continue;
+            covered = 1;
+            const typename D::value_type d = D::quantize(z + ms.dz[k]);
+            typename D::value_type& stored = depth[k * ms.depthPitch + i];
+            if(S::depthTest && !D::test(d, stored)) continue;
+            if constexpr (S::depthWrite) stored = d;
+            pass |= 1 << k;
+        }
+        count.tested += covered;
+        count.passed += pass != 0;
+        if constexpr (F::color){
+            if(pass){
+                const uint32_t src = F::template scalar<D>(sh, z, i);
+                uint8_t* pixel = color + i*4;
+                if(pass == (1 << SAMPLES) - 1 && (S::blend == blend_t::none || !expanded[i])){
+                    const uint32_t rgba = blendScalar<S::blend>(src, pixel);
+                    memcpy(pixel, &rgba, 4);
+                    expanded[i] = 0;
+                } else {
+                    if(!expanded[i]){
+                        for(int k = 0; k < SAMPLES; k++) memcpy(samples + k * ms.colorPitch + i*4, pixel, 4);
+                        expanded[i] = 1;
+                    }
+                    for(int k = 0; k < SAMPLES; k++){
+                        if(!(pass & (1 << k))) continue;
+                        uint8_t* sample = samples + k * ms.colorPitch + i*4;
+                        const uint32_t rgba = blendScalar<S::blend>(src, sample);
+                        memcpy(sample, &rgba, 4);
+                    }
+                }
+            }
+        }
+        w0 += s.a0; w1 += s.a1; w2 += s.a2;
+    }
+    return count;
+}
+
+template<typename D, typename P>
+inline spancount_t spanMSAATail(const span_t& s, const msaa_t& ms, const shade_t& sh, int i, uint8_t* color, uint8_t* samples,
+                                uint8_t* expanded, typename D::value_type* depth){
+    if(i >= s.n) return {};
+    span_t t = s;
+    t.first = i;
+    return spanMSAAScalar<D, P>(t, ms, sh, color, samples, expanded, depth);
+}
+
+#ifdef SPAN_X86
+// alpha blend of pixels unpacked to 16 bits a channel: (s*a + d*(255-a)) / 255, rounded
+__attribute__((target("sse4.1")))
+inline __m128i blendAlpha16(__m128i s, __m128i d){
+    const __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+    const __m128i x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a))),
+                                    _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+inline __m256i blendAlpha16(__m256i s, __m256i d){
+    const __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+    const __m256i x = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a))),
+                                       _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+// src blended onto dst for the 4 or 8 pixels of a vector
+template<blend_t B>
+__attribute__((target("sse4.1")))
+inline __m128i blendSSE4(__m128i src, __m128i dst){
+    if constexpr (B == blend_t::none) return src;
+    else if constexpr (B == blend_t::add) return _mm_adds_epu8(src, dst);
+    else {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lo = blendAlpha16(_mm_unpacklo_epi8(src, zero), _mm_unpacklo_epi8(dst, zero));
+        const __m128i hi = blendAlpha16(_mm_unpackhi_epi8(src, zero), _mm_unpackhi_epi8(dst, zero));
+        return _mm_packus_epi16(lo, hi);
+    }
+}
+
+template<blend_t B>
+__attribute__((target("avx2")))
+inline __m256i blendAVX2(__m256i src, __m256i dst){
+    if constexpr (B == blend_t::none) return src;
+    else if constexpr (B == blend_t::add) return _mm256_adds_epu8(src, dst);
+    else {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i lo = blendAlpha16(_mm256_unpacklo_epi8(src, zero), _mm256_unpacklo_epi8(dst, zero));
+        const __m256i hi = blendAlpha16(_mm256_unpackhi_epi8(src, zero), _mm256_unpackhi_epi8(dst, zero));
+        return _mm256_packus_epi16(lo, hi);
+    }
+}
+
+template<typename D, typename P>
+__attribute__((target("sse4.1")))
+inline spancount_t spanSSE4(const span_t& s, const shade_t& sh, uint8_t* color, typename D::value_type* depth){
+    using T = typename D::value_type;
+    using S = typename P::state;
+    using F = typename P::fragment;
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3), start = _mm_add_epi32(lane, _mm_set1_epi32(s.first));
+    __m128i w0 = _mm_add_epi32(_mm_set1_epi32(s.w0), _mm_mullo_epi32(start, _mm_set1_epi32(s.a0)));
+    __m128i w1 = _mm_add_epi32(_mm_set1_epi32(s.w1), _mm_mullo_epi32(start, _mm_set1_epi32(s.a1)));
+    __m128i w2 = _mm_add_epi32(_mm_set1_epi32(s.w2), _mm_mullo_epi32(start, _mm_set1_epi32(s.a2)));
+    const __m128i step0 = _mm_set1_epi32(s.a0 * 4), step1 = _mm_set1_epi32(s.a1 * 4), step2 = _mm_set1_epi32(s.a2 * 4);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(static_cast<float>(D::scale));
+
+    // only whole groups of 4 are stored, the tail is finished scalar so
+    // nothing past the span is ever written
+    spancount_t count;
+    int i = s.first;
+    for(; i + 4 <= s.n; i += 4){
+        // a lane is inside when no edge value has its sign bit set
+        const __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w0, w1), w2), _mm_set1_epi32(-1));
+        if(const int lanes = _mm_movemask_ps(_mm_castsi128_ps(inside))){
+            count.tested += std::popcount(static_cast<unsigned>(lanes));
+            const __m128 z = _mm_add_ps(_mm_set1_ps(s.z), _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(lane, _mm_set1_epi32(i))),
+                                                                    _mm_set1_ps(s.dzdx)));
+            const __m128 zc = _mm_min_ps(_mm_max_ps(z, zero), one);
+            __m128i pass = inside;
+            if constexpr (D::integer){
+                const __m128i key = _mm_cvttps_epi32(_mm_mul_ps(zc, scale));
+                __m128i old;
+                if constexpr (sizeof(T) == 2) old = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(depth + i)));
+                else                          old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i));
+                if constexpr (S::depthTest)
+                    pass = _mm_and_si128(inside, D::reversed ? _mm_cmpgt_epi32(key, old) : _mm_cmpgt_epi32(old, key));
+                if constexpr (S::depthWrite){
+                    const __m128i merged = _mm_blendv_epi8(old, key, pass);
+                    if constexpr (sizeof(T) == 2) _mm_storel_epi64(reinterpret_cast<__m128i*>(depth + i), _mm_packus_epi32(merged, merged));
+                    else                          _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i), merged);
+                }
+            } else {
+                const __m128 old = _mm_loadu_ps(depth + i);
+                if constexpr (S::depthTest)
+                    pass = _mm_and_si128(inside, _mm_castps_si128(D::reversed ? _mm_cmpgt_ps(zc, old) : _mm_cmplt_ps(zc, old)));
+                if constexpr (S::depthWrite) _mm_storeu_ps(depth + i, _mm_blendv_ps(old, zc, _mm_castsi128_ps(pass)));
+            }
+            count.passed += std::popcount(static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(pass))));
+            if constexpr (F::color){
+                if(_mm_movemask_ps(_mm_castsi128_ps(pass))){
+                    __m128i* cp = reinterpret_cast<__m128i*>(color + i*4);
+                    const __m128i old = _mm_loadu_si128(cp);
+                    const __m128i rgba = blendSSE4<S::blend>(F::template sse4<D>(sh, zc, i), old);
+                    _mm_storeu_si128(cp, _mm_blendv_epi8(old, rgba, pass));
+                }
+            }
+        }
+        w0 = _mm_add_epi32(w0, step0); w1 = _mm_add_epi32(w1, step1); w2 = _mm_add_epi32(w2, step2);
+    }
+    return count + spanTail<D, P>(s, sh, i, color, depth);
+}
+
+// Depth test and write for the 8 pixels at depth whose lanes are set in inside,
+// z already clamped to [0,1]; returns the lanes that passed.
+template<typename D, typename S>
+__attribute__((target("avx2")))
+inline __m256i depthAVX2(typename D::value_type* depth, __m256i inside, __m256 zc){
+    using T = typename D::value_type;
+    __m256i pass = inside;
+    if constexpr (!S::depthTest && !S::depthWrite) return pass;
+    else if constexpr (D::integer){
+        const __m256i key = _mm256_cvttps_epi32(_mm256_mul_ps(zc, _mm256_set1_ps(static_cast<float>(D::scale))));
+        if constexpr (sizeof(T) == 2){
+            __m128i* dp = reinterpret_cast<__m128i*>(depth);
+            const __m256i old = _mm256_cvtepu16_epi32(_mm_loadu_si128(dp));
+            if constexpr (S::depthTest)
+                pass = _mm256_and_si256(inside, D::reversed ? _mm256_cmpgt_epi32(key, old) : _mm256_cmpgt_epi32(old, key));
+            if constexpr (S::depthWrite){
+                const __m256i merged = _mm256_blendv_epi8(old, key, pass);
+                const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(merged, merged), 0x08);
+                _mm_storeu_si128(dp, _mm256_castsi256_si128(packed));
+            }
+        } else {
+            int* dp = reinterpret_cast<int*>(depth);
+            if constexpr (S::depthTest){
+                const __m256i old = _mm256_maskload_epi32(dp, inside);
+                pass = _mm256_and_si256(inside, D::reversed ? _mm256_cmpgt_epi32(key, old) : _mm256_cmpgt_epi32(old, key));
+            }
+            if constexpr (S::depthWrite) _mm256_maskstore_epi32(dp, pass, key);
+        }
+    } else {
+        if constexpr (S::depthTest){
+            const __m256 old = _mm256_maskload_ps(depth, inside);
+            pass = _mm256_and_si256(inside, _mm256_castps_si256(
+                _mm256_cmp_ps(zc, old, D::reversed ? _CMP_GT_OQ : _CMP_LT_OQ)));
+        }
+        if constexpr (S::depthWrite) _mm256_maskstore_ps(depth, pass, zc);
+    }
+    return pass;
+}
+
+template<typename D, typename P>
+__attribute__((target("avx2")))
+inline spancount_t spanAVX2(const span_t& s, const shade_t& sh, uint8_t* color, typename D::value_type* depth){
+    using T = typename D::value_type;
+    using S = typename P::state;
+    using F = typename P::fragment;
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), start = _mm256_add_epi32(lane, _mm256_set1_epi32(s.first));
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(s.w0), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a0)));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(s.w1), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a1)));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(s.w2), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a2)));
+    const __m256i step0 = _mm256_set1_epi32(s.a0 * 8), step1 = _mm256_set1_epi32(s.a1 * 8), step2 = _mm256_set1_epi32(s.a2 * 8);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+    // 32-bit depth uses masked loads/stores all the way to the end of the span;
+    // 16-bit depth has no masked store, so its last partial group goes scalar
+    const int n = sizeof(T) == 2 ? s.n - 7 : s.n;
+    spancount_t count;
+    int i = s.first;
+    for(; i < n; i += 8){
+        const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(s.n - i), lane);
+        const __m256i inside = _mm256_and_si256(tail,
+            _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w0, w1), w2), _mm256_set1_epi32(-1)));
+        if(!_mm256_testz_si256(inside, inside)){
+            const __m256 z = _mm256_add_ps(_mm256_set1_ps(s.z), _mm256_mul_ps(offsetsAVX2(i), _mm256_set1_ps(s.dzdx)));
+            const __m256 zc = _mm256_min_ps(_mm256_max_ps(z, zero), one);
+            const __m256i pass = depthAVX2<D, S>(depth + i, inside, zc);
+            count.tested += std::popcount(static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(inside))));
+            count.passed += std::popcount(static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(pass))));
+            if constexpr (F::color){
+                if(!_mm256_testz_si256(pass, pass)){
+                    int* cp = reinterpret_cast<int*>(color + i*4);
+                    __m256i rgba = F::template avx2<D>(sh, zc, i, pass);
+                    if constexpr (S::blend != blend_t::none) rgba = blendAVX2<S::blend>(rgba, _mm256_maskload_epi32(cp, pass));
+                    _mm256_maskstore_epi32(cp, pass, rgba);
+                }
+            }
+        }
+        w0 = _mm256_add_epi32(w0, step0); w1 = _mm256_add_epi32(w1, step1); w2 = _mm256_add_epi32(w2, step2);
+    }
+    return count + spanTail<D, P>(s, sh, i, color, depth);
+}
+
+// Multisampled spans 8 pixels at a time, one pass over them per sample. The
+// expanded flags are bytes, read and written only for pixels in the span since
+// the ones past it may belong to a tile another thread is drawing.
+template<typename D, typename P>
+__attribute__((target("avx2")))
+inline spancount_t spanMSAAAVX2(const span_t& s, const msaa_t& ms, const shade_t& sh, uint8_t* color, uint8_t* samples,
+                                uint8_t* expanded, typename D::value_type* depth){
+    using S = typename P::state;
+    using F = typename P::fragment;
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), start = _mm256_add_epi32(lane, _mm256_set1_epi32(s.first));
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(s.w0), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a0)));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(s.w1), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a1)));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(s.w2), _mm256_mullo_epi32(start, _mm256_set1_epi32(s.a2)));
+    const __m256i step0 = _mm256_set1_epi32(s.a0 * 8), step1 = _mm256_set1_epi32(s.a1 * 8), step2 = _mm256_set1_epi32(s.a2 * 8);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256i none = _mm256_setzero_si256(), outside = _mm256_set1_epi32(-1);
+
+    // as in spanAVX2, 16-bit depth finishes its last partial group scalar
+    const int n = sizeof(typename D::value_type) == 2 ? s.n - 7 : s.n;
+    spancount_t count;
+    int i = s.first;
+    for(; i < n; i += 8){
+        const __m256 z = _mm256_add_ps(_mm256_set1_ps(s.z), _mm256_mul_ps(offsetsAVX2(i), _mm256_set1_ps(s.dzdx)));
+        const int lanes = std::min(s.n - i, 8);
+        const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(lanes), lane);
+        __m256i pass[SAMPLES], covered = none, any = none, all = outside;
+        for(int k = 0; k < SAMPLES; k++){
+            const __m256i e = _mm256_or_si256(_mm256_or_si256(_mm256_add_epi32(w0, _mm256_set1_epi32(ms.o0[k])),
+                                                              _mm256_add_epi32(w1, _mm256_set1_epi32(ms.o1[k]))),
+                                              _mm256_add_epi32(w2, _mm256_set1_epi32(ms.o2[k])));
+            const __m256i inside = _mm256_and_si256(tail, _mm256_cmpgt_epi32(e, outside));
+            covered = _mm256_or_si256(covered, inside);
+            pass[k] = none;
+            if(!_mm256_testz_si256(inside, inside)){
+                const __m256 zk = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(z, _mm256_set1_ps(ms.dz[k])), zero), one);
+                pass[k] = depthAVX2<D, S>(depth + k * ms.depthPitch + i, inside, zk);
+            }
+            any = _mm256_or_si256(any, pass[k]);
+            all = _mm256_and_si256(all, pass[k]);
+        }
+        count.tested += std::popcount(static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(covered))));
+        count.passed += std::popcount(static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(any))));
+        if constexpr (F::color){
+            if(!_mm256_testz_si256(any, any)){
+                const __m256 zc = _mm256_min_ps(_mm256_max_ps(z, zero), one);
+                const __m256i rgba = F::template avx2<D>(sh, zc, i, any);
+                int* cp = reinterpret_cast<int*>(color + i*4);
+                uint64_t bytes = 0;
+                memcpy(&bytes, expanded + i, lanes);
+                const __m256i exp = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(static_cast<long long>(bytes))), none);
+                const __m256i whole = S::blend == blend_t::none ? all : _mm256_andnot_si256(exp, all);
+                const __m256i partial = _mm256_andnot_si256(whole, any);
+                if(!_mm256_testz_si256(whole, whole)){
+                    __m256i out = rgba;
+                    if constexpr (S::blend != blend_t::none) out = blendAVX2<S::blend>(rgba, _mm256_maskload_epi32(cp, whole));
+                    _mm256_maskstore_epi32(cp, whole, out);
+                }
+                if(!_mm256_testz_si256(partial, partial)){
+                    const __m256i fresh = _mm256_andnot_si256(exp, partial);
+                    if(!_mm256_testz_si256(fresh, fresh)){
+                        const __m256i pixel = _mm256_maskload_epi32(cp, fresh);
+                        for(int k = 0; k < SAMPLES; k++)
+                            _mm256_maskstore_epi32(reinterpret_cast<int*>(samples + k * ms.colorPitch + i*4), fresh, pixel);
+                    }
+                    for(int k = 0; k < SAMPLES; k++){
+                        const __m256i m = _mm256_and_si256(pass[k], partial);
+                        if(_mm256_testz_si256(m, m)) continue;
+                        int* sp = reinterpret_cast<int*>(samples + k * ms.colorPitch + i*4);
+                        __m256i out = rgba;
+                        if constexpr (S::blend != blend_t::none) out = blendAVX2<S::blend>(rgba, _mm256_maskload_epi32(sp, m));
+                        _mm256_maskstore_epi32(sp, m, out);
+                    }
+                }
+                // flags back to bytes: expanded stays or turns on unless the pixel went whole
+                const __m256i flags = _mm256_and_si256(_mm256_andnot_si256(whole, _mm256_or_si256(exp, partial)), _mm256_set1_epi32(1));
+                const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(flags), _mm256_extracti128_si256(flags, 1));
+                bytes = static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_packus_epi16(words, words)));
+                memcpy(expanded + i, &bytes, lanes);
+            }
+        }
+        w0 = _mm256_add_epi32(w0, step0); w1 = _mm256_add_epi32(w1, step1); w2 = _mm256_add_epi32(w2, step2);
+    }
+    return count + spanMSAATail<D, P>(s, ms, sh, i, color, samples, expanded, depth);
+}
+#endif
+
+// Runs of pixels a visibility buffer's shading pass found showing one triangle
+// (see visibility.hpp): n pixels from color get P's fragment shader, nothing
+// tested, varyings in sh at the first pixel and depth from z in dzdx steps.
+// Opaque only, the pass has no blending to do.
+template<typename D, typename P>
+using runfn_t = void (*)(const shade_t&, float z, float dzdx, int n, uint8_t* color);
+
+template<typename D, typename P>
+inline void runScalar(const shade_t& sh, float z, float dzdx, int n, uint8_t* color){
+    using F = typename P::fragment;
+    for(int i = 0; i < n; i++){
+        const uint32_t rgba = F::template scalar<D>(sh, std::clamp(z + dzdx * static_cast<float>(i), 0.0f, 1.0f), i);
+        memcpy(color + i*4, &rgba, 4);
+    }
+}
+
+#ifdef SPAN_X86
+template<typename D, typename P>
+__attribute__((target("avx2")))
+inline void runAVX2(const shade_t& sh, float z, float dzdx, int n, uint8_t* color){
+    using F = typename P::fragment;
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    for(int i = 0; i < n; i += 8){
+        const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), lane);
+        const __m256 zi = _mm256_add_ps(_mm256_set1_ps(z), _mm256_mul_ps(offsetsAVX2(i), _mm256_set1_ps(dzdx)));
+        const __m256i rgba = F::template avx2<D>(sh, _mm256_min_ps(_mm256_max_ps(zi, zero), one), i, tail);
+        _mm256_maskstore_epi32(reinterpret_cast<int*>(color + i*4), tail, rgba);
+    }
+}
+#endif
+
+using spankernel_t =
+struct spankernel {
+    const char* name;
+    int isa; // 0 scalar, 1 sse4.1, 2 avx2
+};
+
+// widest kernel the running cpu supports, or the named one if it is supported too
+inline spankernel_t selectSpanKernel(std::string_view want = {}){
+    spankernel_t kernels[3] = {{"scalar", 0}};
+    int n = 1;
+#ifdef SPAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.1")) kernels[n++] = {"sse4", 1};
+    if(__builtin_cpu_supports("avx2"))   kernels[n++] = {"avx2", 2};
+#endif
+    for(int i = 0; i < n; i++)
+        if(want == kernels[i].name) return kernels[i];
+    return kernels[n-1];
+}
+
+inline spankernel_t spanKernel = selectSpanKernel();
+
+// fragment shaders without an sse4 version run scalar on sse4-only machines,
+// without a gather there is little to win for them
+template<typename D, typename P>
+inline spanfn_t<D, P> spanFunction(int isa){
+#ifdef SPAN_X86
+    if(isa == 2) return spanAVX2<D, P>;
+    if constexpr (P::fragment::hasSSE4)
+        if(isa == 1) return spanSSE4<D, P>;
+#endif
+    (void)isa;
+    return spanScalar<D, P>;
+}
+
+// multisampled spans have no sse4 kernel
+template<typename D, typename P>
+inline msaafn_t<D, P> msaaFunction(int isa){
+#ifdef SPAN_X86
+    if(isa == 2) return spanMSAAAVX2<D, P>;
+#endif
+    (void)isa;
+    return spanMSAAScalar<D, P>;
+}
+
+// runs have no sse4 kernel either, the scalar one is what the span kernels
+// fall back to for most fragment shaders there anyway
+template<typename D, typename P>
+inline runfn_t<D, P> runFunction(int isa){
+#ifdef SPAN_X86
+    if(isa == 2) return runAVX2<D, P>;
+#endif
+    (void)isa;
+    return runScalar<D, P>;
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "framebuffer.hpp"
+
+// One mip level as the span kernels see it. Texels are RGBA32 like the color
+// buffer and stored in 4x4 blocks, one 64-byte cache line each, blocks row by
+// row: a pixel's neighbours along either screen axis mostly land in the same
+// line, where a linear layout would put every step in v a whole row away.
+using miplevel_t =
+struct miplevel {
+    const uint32_t* texels;
+    int w, h;  // powers of two, coordinates wrap
+    int shift; // log2 of blocks per row
+
+    static uint32_t swizzle(int x, int y, int shift){
+        return (((static_cast<uint32_t>(y) >> 2 << shift) + (static_cast<uint32_t>(x) >> 2)) << 4) |
+               ((y & 3) << 2) | (x & 3);
+    }
+    uint32_t fetch(int x, int y) const { return texels[swizzle(x & (w - 1), y & (h - 1), shift)]; }
+};
+
+// Mipmapped texture. Sources of any size are resampled up to powers of two,
+// then each level is a 2x2 box filter of the one above, down to 1x1.
+using texture_t =
+struct texture {
+    texture() = default;
+    texture(int w, int h, const std::vector<uint32_t>& rgba){
+        const int pw = static_cast<int>(std::bit_ceil(static_cast<unsigned>(std::max(w, 1))));
+        const int ph = static_cast<int>(std::bit_ceil(static_cast<unsigned>(std::max(h, 1))));
+        std::vector<uint32_t> level(pw * ph);
+        for(int y = 0; y < ph; y++)
+            for(int x = 0; x < pw; x++)
+                level[y * pw + x] = rgba[(y * h / ph) * w + x * w / pw];
+
+        for(int lw = pw, lh = ph; ; ){
+            store(level, lw, lh);
+            if(lw == 1 && lh == 1) break;
+            const int nw = std::max(lw / 2, 1), nh = std::max(lh / 2, 1);
+            std::vector<uint32_t> next(nw * nh);
+            for(int y = 0; y < nh; y++)
+                for(int x = 0; x < nw; x++){
+                    const int x0 = std::min(2 * x, lw - 1), x1 = std::min(2 * x + 1, lw - 1);
+                    const int y0 = std::min(2 * y, lh - 1), y1 = std::min(2 * y + 1, lh - 1);
+                    const uint32_t q[4] = {level[y0 * lw + x0], level[y0 * lw + x1], level[y1 * lw + x0], level[y1 * lw + x1]};
+                    uint32_t out = 0;
+                    for(int c = 0; c < 32; c += 8){
+                        uint32_t sum = 2;
+                        for(uint32_t t : q) sum += (t >> c) & 0xFF;
+                        out |= (sum / 4) << c;
+                    }
+                    next[y * nw + x] = out;
+                }
+            level.swap(next);
+            lw = nw; lh = nh;
+        }
+    }
+
+    // binary PPM (P6, 8 bits), false when the file is missing or not one
+    static bool load(const std::string& path, texture& out){
+        std::ifstream in(path, std::ios::binary);
+        std::string magic;
+        in >> magic;
+        if(!in || magic != "P6") return false;
+        int header[3], n = 0;
+        while(n < 3 && in){
+            in >> std::ws;
+            if(in.peek() == '#'){ in.ignore(1 << 16, '\n'); continue; }
+            in >> header[n++];
+        }
+        if(!in || header[0] <= 0 || header[1] <= 0 || header[2] != 255) return false;
+        in.get();
+        const int w = header[0], h = header[1];
+        std::vector<uint8_t> rgb(w * h * 3);
+        if(!in.read(reinterpret_cast<char*>(rgb.data()), rgb.size())) return false;
+        std::vector<uint32_t> rgba(w * h);
+        for(int i = 0; i < w * h; i++)
+            rgba[i] = rgb[3*i] | rgb[3*i + 1] << 8 | rgb[3*i + 2] << 16 | 0xFF000000u;
+        out = texture(w, h, rgba);
+        return true;
+    }
+
+    // stand-in for models that ship without one: a two-tone checker with a thin
+    // grid, busy enough that missing mipmaps or a wrong perspective would show
+    static texture checker(int size = 256, int squares = 16){
+        std::vector<uint32_t> rgba(size * size);
+        const int cell = size / squares;
+        for(int y = 0; y < size; y++)
+            for(int x = 0; x < size; x++){
+                const bool odd = ((x / cell) ^ (y / cell)) & 1;
+                const bool grid = x % cell == 0 || y % cell == 0;
+                rgba[y * size + x] = grid ? 0xFF303030u : odd ? 0xFF5A6E8Cu : 0xFF9AB4C8u;
+            }
+        return texture(size, size, rgba);
+    }
+
+    int levels() const { return static_cast<int>(offsets.size()); }
+    int width() const { return sizes.empty() ? 0 : sizes[0][0]; }
+    int height() const { return sizes.empty() ? 0 : sizes[0][1]; }
+
+    miplevel_t level(int i) const {
+        const int w = sizes[i][0], h = sizes[i][1];
+        return {storage.data() + offsets[i], w, h, std::countr_zero(static_cast<unsigned>(std::max(w / 4, 1)))};
+    }
+
+    // Level for a whole triangle from its texel to pixel area ratio, both given
+    // as twice the area (uv units for the texture). Perspective changes the
+    // ratio across large triangles; one level for all of it is the usual trade.
+    int lod(float uvArea2, float pixelArea2) const {
+        const float texels = std::abs(uvArea2) * static_cast<float>(width()) * static_cast<float>(height());
+        if(!(texels > pixelArea2) || pixelArea2 <= 0.0f) return 0;
+        const int l = static_cast<int>(0.5f * std::log2(texels / pixelArea2) + 0.5f);
+        return std::min(l, levels() - 1);
+    }
+
+private:
+    void store(const std::vector<uint32_t>& level, int w, int h){
+        const int bx = std::max(w / 4, 1), by = std::max(h / 4, 1);
+        const int shift = std::countr_zero(static_cast<unsigned>(bx));
+        offsets.push_back(storage.size());
+        sizes.push_back({w, h});
+        storage.resize(storage.size() + bx * by * 16);
+        uint32_t* out = storage.data() + offsets.back();
+        for(int y = 0; y < h; y++)
+            for(int x = 0; x < w; x++)
+                out[miplevel_t::swizzle(x, y, shift)] = level[y * w + x];
+    }
+
+    std::vector<uint32_t, aligned<uint32_t>> storage; // every level, blocked
+    std::vector<size_t> offsets;                      // per level, into storage
+    std::vector<vec<int, 2>> sizes;
+};
@@ -0,0 +1,137 @@
+#pragma once
+// Scoped-zone tracer, compiled in with -DTRACE (TRACE=1 ./build) and out
+// entirely otherwise: the macros below are all there is to it then.
+//
+//   TRACE_ZONE("bin");               the enclosing scope, as a slice
+//   TRACE_COUNTER("triangles", n);   a counter track sample
+//   TRACE_THREAD("render");          names the calling thread's track
+//
+// Every thread writes its events to a ring of its own, registered once under a
+// lock and then written lock-free: the one producer stores the event and
+// publishes it by bumping the ring's head, so the hot path is two timestamps
+// and a 32-byte store. A full ring overwrites its oldest events. Timestamps are
+// rdtsc ticks where there is one, converted with the tick rate measured
+// against steady_clock over the run; steady_clock nanoseconds elsewhere. At
+// exit every ring is written out as Chrome trace JSON (trace.json, or the
+// --trace path), which chrome://tracing and ui.perfetto.dev open as is.
+#ifdef TRACE
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using tracer_t =
+struct tracer {
+    static constexpr size_t RING = 1 << 16; // events per thread
+
+    struct event {
+        const char* name; // string literal, lives as long as the program
+        uint64_t start;   // ticks
+        uint64_t value;   // end ticks for zones, the sample for counters
+        bool counter;
+    };
+
+    struct ring {
+        std::atomic<uint64_t> head = 0; // events ever written, the last RING of them kept
+        std::vector<event> events = std::vector<event>(RING);
+        std::string name;
+        uint32_t tid;
+
+        void push(const event& e){
+            const uint64_t h = head.load(std::memory_order_relaxed);
+            events[h & (RING - 1)] = e;
+            head.store(h + 1, std::memory_order_release);
+        }
+    };
+
+    static uint64_t now(){
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    tracer() : ticks0(now()), clock0(std::chrono::steady_clock::now()) {}
+    ~tracer(){ write(); }
+
+    // the calling thread's ring, registered on first use
+    ring& local(){
+        thread_local ring* mine = nullptr;
+        if(!mine){
+            std::lock_guard lock(mutex);
+            rings.push_back(std::make_unique<ring>());
+            mine = rings.back().get();
+            mine->tid = static_cast<uint32_t>(rings.size());
+            mine->name = "thread " + std::to_string(mine->tid);
+        }
+        return *mine;
+    }
+
+    void write(){
+        std::lock_guard lock(mutex);
+        if(path.empty() || rings.empty()) return;
+        // ticks per microsecond over the whole run
+        const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - clock0).count();
+        const double rate = us > 0.0 ? static_cast<double>(now() - ticks0) / us : 1.0;
+        auto time = [&](uint64_t t){ return static_cast<double>(t - ticks0) / rate; };
+
+        std::ofstream out(path);
+        out.precision(15);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for(const auto& r : rings){
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << r->tid
+                << ",\"args\":{\"name\":\"" << r->name << "\"}}";
+            first = false;
+            const uint64_t head = r->head.load(std::memory_order_acquire);
+            for(uint64_t i = head > RING ? head - RING : 0; i < head; i++){
+                const event& e = r->events[i & (RING - 1)];
+                out << ",\n{\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << r->tid << ",\"ts\":" << time(e.start);
+                if(e.counter) out << ",\"ph\":\"C\",\"args\":{\"value\":" << e.value << "}}";
+                else out << ",\"ph\":\"X\",\"dur\":" << (e.value - e.start) / rate << '}';
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    std::string path = "trace.json";
+    uint64_t ticks0;
+    std::chrono::steady_clock::time_point clock0;
+    std::mutex mutex; // registration and the final write only
+    std::vector<std::unique_ptr<ring>> rings;
+};
+
+inline tracer_t& tracing(){
+    static tracer_t t;
+    return t;
+}
+
+using tracezone_t =
+struct tracezone {
+    explicit tracezone(const char* name) : name(name), start(tracer_t::now()) {}
+    ~tracezone(){ tracing().local().push({name, start, tracer_t::now(), false}); }
+    const char* name;
+    uint64_t start;
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_ZONE(label) tracezone_t TRACE_JOIN(traceZone, __LINE__)(label)
+#define TRACE_COUNTER(label, value) \
+    tracing().local().push({(label), tracer_t::now(), static_cast<uint64_t>(value), true})
+#define TRACE_THREAD(label) (tracing().local().name = (label))
+#else
+#define TRACE_ZONE(label) ((void)0)
+#define TRACE_COUNTER(label, value) ((void)0)
+#define TRACE_THREAD(label) ((void)0)
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "clip.hpp"
+#include "framebuffer.hpp"
+#include "geometry.hpp"
+#include "model.hpp"
+#include "raster.hpp"
+#include "trace.hpp"
+
+// Post-transform vertex buffer, one entry per model vertex, structure-of-arrays
+// so the vertex stage is a straight vectorizable loop and setup gathers by index.
+using clipbuffer_t =
+struct clipbuffer {
+    // clip space
+    std::vector<float, aligned<float>> x, y, z, w;
+    // viewport space (x, y in subpixels), only meaningful when the outcode has no clipNeeded bits
+    std::vector<int32_t, aligned<int32_t>> sx, sy;
+    std::vector<float, aligned<float>> sz;
+    std::vector<uint16_t, aligned<uint16_t>> code; // clip*/guard* outcode bits
+
+    void resize(size_t n){
+        x.resize(n); y.resize(n); z.resize(n); w.resize(n);
+        sx.resize(n); sy.resize(n); sz.resize(n);
+        code.resize(n);
+    }
+    size_t size() const { return x.size(); }
+    screen_t screen(size_t i) const { return {sx[i], sy[i], sz[i]}; }
+    clipvert_t clip(size_t i) const { return {x[i], y[i], z[i], w[i]}; }
+};
+
+// Part of a batched draw: one instance's vertices [first, end), or its faces.
+// The instance's vertex i sits at base + i in the clip buffer and transforms
+// by the instance's mvp. Only the span of vertices an instance uses gets room,
+// so base may be negative.
+using instancerun_t =
+struct instancerun {
+    uint32_t first, end;
+    int64_t base;
+    uint32_t instance;
+};
+
+// Transforms each vertex in the given runs exactly once per frame, every
+// instance's runs in one parallel loop; faces then index the result. An
+// instance's runs must not overlap (bvh_t::cull merges them). count is the
+// clip buffer size the bases were handed out from.
+inline void transformVertices(const std::vector<vertex_t>& vertices, const std::vector<instancerun_t>& runs,
+                              const mat<float, 4, 4>* mvps, size_t count, const frustum_t& frustum, clipbuffer_t& out){
+    TRACE_ZONE("transform");
+    out.resize(count);
+    const vertex_t* v = vertices.data();
+    float* __restrict cx = out.x.data();
+    float* __restrict cy = out.y.data();
+    float* __restrict cz = out.z.data();
+    float* __restrict cw = out.w.data();
+    int32_t* __restrict sx = out.sx.data();
+    int32_t* __restrict sy = out.sy.data();
+    float* __restrict sz = out.sz.data();
+    uint16_t* __restrict code = out.code.data();
+    // a local so the loop body reads registers, not shared memory the vectorizer can't prove constant
+    const frustum_t f = frustum;
+
+    // cut the runs into fixed-size pieces so one big run still spreads over all threads
+    constexpr uint32_t CHUNK = 2048;
+    std::vector<instancerun_t> chunks;
+    for(const auto& r : runs)
+        for(uint32_t first = r.first; first < r.end; first += CHUNK)
+            chunks.push_back({first, std::min(first + CHUNK, r.end), r.base, r.instance});
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t c = 0; c < chunks.size(); c++){
+        TRACE_ZONE("transform chunk");
+        const mat<float, 4, 4> m = mvps[chunks[c].instance];
+        const int64_t base = chunks[c].base;
+        #pragma omp simd
+        for(size_t i = chunks[c].first; i < chunks[c].end; i++){
+            const float px = v[i][0], py = v[i][1], pz = v[i][2];
+            const float x = m[0][0]*px + m[0][1]*py + m[0][2]*pz + m[0][3];
+            const float y = m[1][0]*px + m[1][1]*py + m[1][2]*pz + m[1][3];
+            const float z = m[2][0]*px + m[2][1]*py + m[2][2]*pz + m[2][3];
+            const float w = m[3][0]*px + m[3][1]*py + m[3][2]*pz + m[3][3];
+            const size_t o = static_cast<size_t>(base + static_cast<int64_t>(i));
+            cx[o] = x; cy[o] = y; cz[o] = z; cw[o] = w;
+
+            code[o] = f.code(x, y, w);
+            // vertices behind the eye get a harmless divisor, their faces are clipped in clip space
+            const screen_t s = toViewport(x, y, z, w > 1e-6f ? w : 1.0f, f);
+            sx[o] = s.x; sy[o] = s.y; sz[o] = s.z; // z already [0,1], see updateMVP
+        }
+    }
+}
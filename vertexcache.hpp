@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.hpp"
+
+// Face order for vertex reuse. Faces are 1-based indices into the vertices.
+// Locality is measured the way hardware would see it: a FIFO of the last
+// VERTEX_CACHE vertices transformed, ACMR being misses per face (0.5 is the
+// ideal for a large regular mesh, 3 means no reuse at all).
+constexpr uint32_t VERTEX_CACHE = 16;
+
+inline double acmr(const std::vector<vec<uint32_t, 3>>& faces, size_t vertexCount, uint32_t cacheSize = VERTEX_CACHE){
+    if(faces.empty()) return 0.0;
+    std::vector<uint64_t> stamp(vertexCount + 1, 0); // when each vertex last entered the cache
+    uint64_t time = cacheSize + 1, misses = 0;
+    for(const auto& f : faces)
+        for(size_t k = 0; k < 3; k++)
+            if(time - stamp[f[k]] > cacheSize){
+                stamp[f[k]] = time++;
+                misses++;
+            }
+    return static_cast<double>(misses) / static_cast<double>(faces.size());
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007) over faces [first, end): fans around
+// one vertex at a time, moving on to the oldest neighbour that will still be in
+// the cache once its own fan is out, and back to a recent vertex with faces
+// left at a dead end. stamp and time carry the simulated cache from one call to the
+// next, so a run of calls over consecutive ranges chains them; stamp is sized
+// vertexCount + 1 and starts all zero.
+inline void tipsify(std::vector<vec<uint32_t, 3>>& faces, size_t first, size_t end,
+                    std::vector<uint64_t>& stamp, uint64_t& time, uint32_t cacheSize = VERTEX_CACHE){
+    const size_t count = end - first;
+    if(count < 2) return;
+
+    // the range's vertices, local numbering in order of first appearance
+    std::vector<uint32_t> local;
+    local.reserve(count * 3);
+    for(size_t i = first; i < end; i++)
+        for(size_t k = 0; k < 3; k++) local.push_back(faces[i][k]);
+    std::vector<uint32_t> sorted = local;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    auto id = [&](uint32_t v){ return static_cast<uint32_t>(std::lower_bound(sorted.begin(), sorted.end(), v) - sorted.begin()); };
+    const size_t n = sorted.size();
+
+    // faces around each local vertex, and how many of them are still to go
+    std::vector<uint32_t> start(n + 1, 0), adjacent(count * 3), live(n, 0);
+    for(uint32_t v : local) start[id(v) + 1]++;
+    for(size_t v = 0; v < n; v++) start[v + 1] += start[v];
+    std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+    for(size_t i = 0; i < count * 3; i++){
+        const uint32_t v = id(local[i]);
+        adjacent[fill[v]++] = static_cast<uint32_t>(i / 3);
+        live[v]++;
+    }
+    std::vector<uint32_t> order; // local vertex ids by first appearance, for the dead end sweep
+    std::vector<uint8_t> seen(n, 0);
+    order.reserve(n);
+    for(uint32_t v : local) if(!seen[id(v)]){ seen[id(v)] = 1; order.push_back(id(v)); }
+
+    std::vector<vec<uint32_t, 3>> out;
+    out.reserve(count);
+    std::vector<uint8_t> emitted(count, 0);
+    std::vector<uint32_t> deadEnd, candidates;
+    size_t cursor = 0;
+
+    // start where the cache left off: the range's most recently used vertex
+    int64_t fan = order[0];
+    for(size_t v = 0; v < n; v++) if(stamp[sorted[v]] > stamp[sorted[fan]]) fan = static_cast<int64_t>(v);
+
+    while(fan >= 0){
+        candidates.clear();
+        for(uint32_t a = start[fan]; a < start[fan + 1]; a++){
+            const uint32_t t = adjacent[a];
+            if(emitted[t]) continue;
+            emitted[t] = 1;
+            const vec<uint32_t, 3>& f = faces[first + t];
+            out.push_back(f);
+            for(size_t k = 0; k < 3; k++){
+                const uint32_t v = id(f[k]);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if(time - stamp[f[k]] > cacheSize) stamp[f[k]] = time++;
+            }
+        }
+
+        // the candidate with faces left that stays in the cache the longest after
+        // fanning out its own faces; else the latest dead end, else the next vertex
+        fan = -1;
+        int64_t best = -1;
+        for(uint32_t v : candidates){
+            if(!live[v]) continue;
+            int64_t priority = 0;
+            const int64_t age = static_cast<int64_t>(time - stamp[sorted[v]]);
+            if(age + 2 * static_cast<int64_t>(live[v]) <= static_cast<int64_t>(cacheSize)) priority = age;
+            if(priority > best){ best = priority; fan = v; }
+        }
+        while(fan < 0 && !deadEnd.empty()){
+            const uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if(live[v]) fan = v;
+        }
+        for(; fan < 0 && cursor < n; cursor++)
+            if(live[order[cursor]]) fan = order[cursor];
+    }
+    std::copy(out.begin(), out.end(), faces.begin() + first);
+}
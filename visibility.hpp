@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+#include <vector>
+
+#include "binner.hpp"
+#include "clip.hpp"
+#include "framebuffer.hpp"
+#include "model.hpp"
+#include "shader.hpp"
+#include "span.hpp"
+#include "trace.hpp"
+
+// Visibility buffer (deferred shading). The draws of a frame go through the
+// binner and rasterizer as usual but with idpass_t<P>, which keeps P's depth
+// and cull state and writes a triangle id per pixel instead of shading it: 1 +
+// the index of the face in binner_t::named, which holds the face and its
+// instance slot. Once everything is drawn, the shading pass walks the tiles
+// drawn to and shades each pixel that ended up in front exactly once, whatever
+// the overdraw was. Triangle by triangle it transforms the three corners again,
+// runs the vertex shader on them and inverts the 3x3 of their homogeneous
+// pixel positions, which gives every varying (and depth) as a plane in screen
+// space; corners behind the eye need no special case. Runs of a row showing
+// the same triangle then go through P's fragment shader like a span does.
+// Multisampled targets aren't supported, the draws stay forward there.
+using visibility_t =
+struct visibility {
+    // what the shading pass needs of an instance slot besides its matrices
+    struct instance {
+        const mesh_t* mesh;
+        const texture_t* texture;
+    };
+
+    framebuffer_t ids{0, 0};         // per pixel: 0, or the id of the triangle in front
+    std::vector<instance> instances; // per instance slot of the frame
+
+    // starts a frame at the target's size and layout
+    void clear(int w, int h, bool tiled){
+        if(ids.tiled != tiled) ids = framebuffer_t(w, h, 1, tiled);
+        ids.resize(w, h);
+        ids.clear();
+        instances.clear();
+    }
+
+    // P's fragment shader for every pixel with an id, into target; named are the
+    // binner's faces, mvps and rotations the frame's per slot. Returns the
+    // pixels shaded.
+    template<typename P, typename D>
+    size_t shade(framebuffer_t& target, const std::vector<binner_t::face>& named, const mat<float, 4, 4>* mvps,
+                 const mat<float, 3, 3>* rotations, const vec<float, 3>& light, float ambient, const frustum_t& frustum) const {
+        TRACE_ZONE("shade");
+        const runfn_t<D, P> run = runFunction<D, P>(spanKernel.isa);
+        const int tilesX = ids.tiles.tilesX, count = tilesX * ids.tiles.tilesY;
+        size_t shaded = 0;
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:shaded)
+        for(int tile = 0; tile < count; tile++){
+            if(ids.tiles.state[tile] != tileclear_t::dirty) continue;
+            TRACE_ZONE("shade tile");
+            const int tx = tile % tilesX, ty = tile / tilesX;
+            const int x0 = tx * TILE, x1 = std::min(x0 + TILE, ids.w), y1 = std::min((ty + 1) * TILE, ids.h);
+            target.touch(tx, ty);
+
+            // triangles set up so far in the tile, by id; most are only a few
+            // pixels wide, so a row goes through many before the next comes back
+            std::array<uint32_t, CACHE> cached;
+            cached.fill(0);
+            std::array<planes, CACHE> cache;
+            shade_t sh;
+            sh.ambient = ambient;
+            for(int k = 0; k < 3; k++) sh.light[k] = light[k];
+            for(int y = ty * TILE; y < y1; y++){
+                // from x0, the tile's part of the row
+                const uint32_t* row = reinterpret_cast<const uint32_t*>(ids.at(x0, y));
+                for(int x = x0, end; x < x1; x = end){
+                    const uint32_t id = row[x - x0];
+                    end = x0 + runEnd(row, x - x0, x1 - x0);
+                    if(!id) continue;
+                    planes& p = cache[id % CACHE];
+                    if(cached[id % CACHE] != id){
+                        const binner_t::face& f = named[id - 1];
+                        const instance& in = instances[f.instance];
+                        const shading_t shading = {in.mesh->uvs.data(), in.mesh->normals.data(), in.mesh->colors.data(),
+                                                   in.texture, rotations, light, ambient};
+                        p = setup<P>(in.mesh->vertices, in.mesh->faces[f.index], f.instance, mvps[f.instance], shading, frustum);
+                        cached[id % CACHE] = id;
+                    }
+                    if(!p.valid) continue;
+                    sh.texture = p.texture;
+                    const double px = x + 0.5, py = y + 0.5;
+                    for(int k = 0; k < VARYINGS; k++){
+                        sh.v[k] = static_cast<float>(p.v[k][0] * px + p.v[k][1] * py + p.v[k][2]);
+                        sh.dx[k] = static_cast<float>(p.v[k][0]);
+                    }
+                    run(sh, static_cast<float>(p.z[0] * px + p.z[1] * py + p.z[2]), static_cast<float>(p.z[0]),
+                        end - x, target.at(x, y));
+                    shaded += end - x;
+                }
+            }
+        }
+        return shaded;
+    }
+
+private:
+    static constexpr uint32_t CACHE = 64; // set up triangles kept per tile
+
+    // first pixel in (x, x1) whose id differs from the one at x, or x1; four at a time
+    static int runEnd(const uint32_t* row, int x, int x1){
+        const uint32_t id = row[x];
+        int end = x + 1;
+#if defined(__SSE2__)
+        const __m128i v = _mm_set1_epi32(static_cast<int>(id));
+        for(; end + 4 <= x1; end += 4){
+            const int same = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + end)), v)));
+            if(same != 0xF) return end + std::countr_one(static_cast<unsigned>(same));
+        }
+#endif
+        while(end < x1 && row[end] == id) end++;
+        return end;
+    }
+
+    // a triangle's varyings and depth as planes a*x + b*y + c over pixel
+    // coordinates, and its mip level
+    struct planes {
+        double v[VARYINGS][3];
+        double z[3];
+        miplevel_t texture;
+        bool valid; // false for triangles degenerate in screen space
+    };
+
+    // the vertex stage and setup for one face of an instance, again
+    template<typename P>
+    static planes setup(const std::vector<vertex_t>& vertices, const vec<uint32_t, 3>& face, uint32_t instance,
+                        const mat<float, 4, 4>& m, const shading_t& shading, const frustum_t& frustum){
+        planes p = {};
+        double corner[3][3]; // homogeneous pixel position: x*w, y*w, w
+        float attr[3][VARYINGS] = {}, z[3];
+        bool front = true;
+        for(int k = 0; k < 3; k++){
+            const size_t i = face[k] - 1;
+            const float px = vertices[i][0], py = vertices[i][1], pz = vertices[i][2];
+            const float x = m[0][0]*px + m[0][1]*py + m[0][2]*pz + m[0][3];
+            const float y = m[1][0]*px + m[1][1]*py + m[1][2]*pz + m[1][3];
+            z[k]          = m[2][0]*px + m[2][1]*py + m[2][2]*pz + m[2][3];
+            const float w = m[3][0]*px + m[3][1]*py + m[3][2]*pz + m[3][3];
+            front = front && w >= frustum.nearZ;
+            // the snapped position the raster pass used, where there is one
+            if(w >= frustum.nearZ){
+                const screen_t s = toViewport(x, y, z[k], w, frustum);
+                corner[k][0] = static_cast<double>(s.x) / SUBPIXEL * w;
+                corner[k][1] = static_cast<double>(s.y) / SUBPIXEL * w;
+            } else {
+                corner[k][0] = (0.5 * x + 0.5 * w) * frustum.fw;
+                corner[k][1] = (0.5 * w - 0.5 * y) * frustum.fh;
+            }
+            corner[k][2] = w;
+            attr[k][varW] = 1.0f;
+            P::vertex::attributes(shading, i, instance, attr[k] + 1);
+        }
+
+        // rows of the inverse: corner k's weight, which is 1/w at k and 0 at the
+        // others, so an attribute over w is the weights times the corners' values
+        double e[3][3];
+        for(int k = 0; k < 3; k++){
+            const double* b = corner[(k + 1) % 3];
+            const double* c = corner[(k + 2) % 3];
+            e[k][0] = b[1] * c[2] - b[2] * c[1];
+            e[k][1] = b[2] * c[0] - b[0] * c[2];
+            e[k][2] = b[0] * c[1] - b[1] * c[0];
+        }
+        const double det = corner[0][0] * e[0][0] + corner[0][1] * e[0][1] + corner[0][2] * e[0][2];
+        if(det == 0.0) return p;
+        const double inv = 1.0 / det;
+        for(int j = 0; j < 3; j++){
+            for(int v = 0; v < VARYINGS; v++)
+                p.v[v][j] = (e[0][j] * attr[0][v] + e[1][j] * attr[1][v] + e[2][j] * attr[2][v]) * inv;
+            p.z[j] = (e[0][j] * z[0] + e[1][j] * z[1] + e[2][j] * z[2]) * inv;
+        }
+
+        // the level the forward path picks; triangles reaching behind the eye,
+        // which it clips first, take the finest
+        if constexpr (P::varying){
+            int level = 0;
+            if(front){
+                const double ax = corner[0][0] / corner[0][2], ay = corner[0][1] / corner[0][2];
+                const double pixelArea2 = std::abs((corner[1][0] / corner[1][2] - ax) * (corner[2][1] / corner[2][2] - ay) -
+                                                   (corner[1][1] / corner[1][2] - ay) * (corner[2][0] / corner[2][2] - ax));
+                const float uvArea2 = (attr[1][varU] - attr[0][varU]) * (attr[2][varV] - attr[0][varV]) -
+                                      (attr[1][varV] - attr[0][varV]) * (attr[2][varU] - attr[0][varU]);
+                level = shading.texture->lod(uvArea2, static_cast<float>(pixelArea2));
+            }
+            p.texture = shading.texture->level(level);
+        }
+        p.valid = true;
+        return p;
+    }
+};